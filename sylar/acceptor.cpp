@@ -0,0 +1,127 @@
+#include "acceptor.h"
+#include "log.h"
+#include "macro.h"
+
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+Acceptor::Acceptor(IOManager *iom, Callback cb)
+    : m_iom(iom)
+    , m_cb(cb)
+{
+}
+
+Acceptor::~Acceptor()
+{
+    if (!m_started) {
+        for (int sock : m_socks) {
+            close(sock);
+        }
+    }
+}
+
+bool Acceptor::bind(const sockaddr *addr, socklen_t addrlen, bool reuseport, int backlog)
+{
+    SYLAR_ASSERT(!m_started && m_socks.empty());
+    std::vector<int> threads;
+    if (reuseport) {
+        // use_caller的线程只在stop()里才调度，分给它的连接会一直没人accept
+        for (int id : m_iom->getThreadIds()) {
+            if (id != m_iom->getRootThreadId()) {
+                threads.push_back(id);
+            }
+        }
+    }
+    if (threads.empty()) {
+        reuseport = false;
+        threads.push_back(-1);
+    }
+
+    sockaddr_storage bind_addr;
+    memcpy(&bind_addr, addr, addrlen);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        int sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        bool ok = sock >= 0
+            && !setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on)
+            && (!reuseport || !setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on))
+            && !::bind(sock, (sockaddr *)&bind_addr, addrlen)
+            && !listen(sock, backlog);
+        if (ok && i == 0) {    // 端口是0的话后面的socket要绑到内核分配的这个端口上
+            socklen_t len = addrlen;
+            ok = !getsockname(sock, (sockaddr *)&bind_addr, &len);
+        }
+        if (!ok) {
+            SYLAR_LOG_ERROR(g_logger) << "Acceptor bind sock=" << sock << " reuseport=" << reuseport
+                << " errno=" << errno << " (" << strerror(errno) << ")";
+            if (sock >= 0) {
+                close(sock);
+            }
+            for (int s : m_socks) {
+                close(s);
+            }
+            m_socks.clear();
+            return false;
+        }
+        m_iom->setEventMode(sock, reuseport ? IOManager::PERSIST : IOManager::EXCLUSIVE);
+        m_socks.push_back(sock);
+    }
+    m_threads.swap(threads);
+    m_accepted.assign(m_socks.size(), 0);
+    return true;
+}
+
+void Acceptor::start()
+{
+    SYLAR_ASSERT(!m_started);
+    m_started = true;
+    for (size_t i = 0; i < m_socks.size(); ++i) {
+        m_iom->schedule(std::bind(&Acceptor::acceptLoop, this, i), m_threads[i]);
+    }
+}
+
+void Acceptor::stop()
+{
+    m_stopping = true;
+    for (int sock : m_socks) {
+        m_iom->cancleEvent(sock, IOManager::READ);
+    }
+}
+
+void Acceptor::acceptLoop(size_t idx)
+{
+    int sock = m_socks[idx];
+    while (!m_stopping) {
+        int fd = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            ++m_accepted[idx];
+            m_cb(fd);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            SYLAR_LOG_ERROR(g_logger) << "accept(" << sock << ") errno=" << errno << " (" << strerror(errno) << ")";
+            break;
+        }
+        if (m_iom->addEvent(sock, IOManager::READ)) {
+            break;
+        }
+        // stop()在注册之前就取消过了的话，自己取消掉，不然会一直等下去
+        if (m_stopping) {
+            m_iom->cancleEvent(sock, IOManager::READ);
+        }
+        Fiber::YieldToHold();
+    }
+    m_iom->cancleAllEvent(sock);
+    close(sock);
+}
+
+}
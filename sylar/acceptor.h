@@ -0,0 +1,46 @@
+#ifndef __SYLAR_ACCEPTOR_H__
+#define __SYLAR_ACCEPTOR_H__
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <sys/socket.h>
+#include "iomanager.h"
+
+namespace sylar {
+
+// 监听socket和accept协程
+// reuseport=true: IOManager的每个工作线程一个监听socket(SO_REUSEPORT绑同一个地址)，内核按连接哈希分到各个socket上，
+//                 每个socket的accept协程固定在自己的线程上，配合iomanager.per_thread_epoll线程之间互不干扰
+// reuseport=false: 只有一个监听socket，用IOManager::EXCLUSIVE模式注册到所有Reactor上，来一个连接只叫醒一个线程
+class Acceptor {
+public:
+    typedef std::shared_ptr<Acceptor> ptr;
+    typedef std::function<void(int fd)> Callback;    // 新连接(非阻塞)，在accept它的线程上调用，fd归回调管；不要在里面阻塞，一般是schedule一个处理协程
+
+    Acceptor(IOManager *iom, Callback cb);
+    ~Acceptor();
+
+    // addr的端口是0的时候，第一个socket由内核分配端口，其他的绑到同一个端口上
+    bool bind(const sockaddr *addr, socklen_t addrlen, bool reuseport = true, int backlog = 1024);
+    void start();
+    void stop();     // 停止accept，监听socket在accept协程退出时关闭
+
+    const std::vector<int> &getSockets() const { return m_socks; }
+    uint64_t getAccepted(size_t idx) const { return m_accepted[idx]; }   // 第idx个socket accept了多少连接
+private:
+    void acceptLoop(size_t idx);
+private:
+    IOManager *m_iom;
+    Callback m_cb;
+    std::vector<int> m_socks;
+    std::vector<int> m_threads;           // 每个socket的accept协程固定在哪个线程上，-1是不固定
+    std::vector<uint64_t> m_accepted;     // 只有对应的accept协程会写
+    std::atomic<bool> m_stopping = {false};
+    bool m_started = false;
+};
+
+}
+
+#endif
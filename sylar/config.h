@@ -383,7 +383,7 @@ public:
         //     return tmp;
         // }
 
-        if (name.find_first_not_of("abcdefggijklmnopqrstuvwxyz._012345678")
+        if (name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789")
                 != std::string::npos) {
             SYLAR_LOG_ERROR(SYLAR_LOG_ROOT()) << "Lookup name invalid " << name;
             throw std::invalid_argument(name);
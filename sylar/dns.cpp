@@ -0,0 +1,578 @@
+#include "dns.h"
+#include "config.h"
+#include "log.h"
+#include "scheduler.h"
+#include "util.h"
+#include "hook.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_dns_cache_size =
+    Config::Lookup<uint32_t>("dns.cache_size", 10000, "dns cache max entries");
+static ConfigVar<uint32_t>::ptr g_dns_max_ttl =
+    Config::Lookup<uint32_t>("dns.max_ttl", 3600, "dns cache max ttl in seconds");
+static ConfigVar<uint32_t>::ptr g_dns_negative_ttl =
+    Config::Lookup<uint32_t>("dns.negative_ttl", 30, "dns negative cache ttl in seconds when no SOA");
+
+static const int QTYPE_A = 1;
+static const int QTYPE_AAAA = 28;
+static const int QTYPE_SOA = 6;
+static const uint32_t NO_TTL = ~0u;    // 回包里没有SOA，查不到的缓存时间用dns.negative_ttl
+
+static std::string to_lower(const std::string &s)
+{
+    std::string r(s);
+    std::transform(r.begin(), r.end(), r.begin(), ::tolower);
+    return r;
+}
+
+static bool parse_ip(const std::string &s, sockaddr_storage &ss, uint16_t port)
+{
+    memset(&ss, 0, sizeof ss);
+    sockaddr_in *in = (sockaddr_in *)&ss;
+    if (inet_pton(AF_INET, s.c_str(), &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        return true;
+    }
+    sockaddr_in6 *in6 = (sockaddr_in6 *)&ss;
+    if (inet_pton(AF_INET6, s.c_str(), &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        return true;
+    }
+    return false;
+}
+
+static socklen_t addr_len(const sockaddr_storage &ss)
+{
+    return ss.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+// www.example.com -> 3www7example3com0
+static bool encode_name(const std::string &name, std::string &out)
+{
+    if (name.empty() || name.size() > 253) {
+        return false;
+    }
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = name.find('.', start);
+        if (dot == std::string::npos) {
+            dot = name.size();
+        }
+        size_t len = dot - start;
+        if (len == 0 || len > 63) {
+            return false;
+        }
+        out.push_back((char)len);
+        out.append(name, start, len);
+        start = dot + 1;
+    }
+    out.push_back('\0');
+    return true;
+}
+
+static uint16_t read16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// 跳过一个(可能带压缩指针的)名字
+static bool skip_name(const uint8_t *buf, size_t len, size_t &pos)
+{
+    while (pos < len) {
+        uint8_t l = buf[pos];
+        if (l == 0) {
+            ++pos;
+            return true;
+        }
+        if ((l & 0xc0) == 0xc0) {
+            pos += 2;
+            return pos <= len;
+        }
+        pos += l + 1;
+    }
+    return false;
+}
+
+// 返回-1表示不是这个请求的回包(或者格式不对)，继续等；否则返回结果，ttl是记录里最小的TTL，
+// 查不到的时候是SOA的min(ttl, minimum)
+// req是发出去的请求：id和问题(名字、类型、IN)都要和它一样才认，名字不区分大小写，
+// 不然同一个端口上别的名字的回包(伪造的或者过期的)会被当成这个名字的结果缓存起来
+static int parse_response(const uint8_t *buf, size_t len, const std::string &req
+        , std::vector<sockaddr_storage> &addrs, uint32_t &ttl)
+{
+    const uint8_t *q = (const uint8_t *)req.data();
+    size_t qlen = req.size() - 12;    // 编码后的名字 + qtype + qclass
+    int qtype = read16(q + req.size() - 4);
+    if (len < 12 + qlen || read16(buf) != read16(q) || !(buf[2] & 0x80) || read16(buf + 4) != 1) {
+        return -1;
+    }
+    for (size_t i = 0; i < qlen - 4; ++i) {
+        if (tolower(buf[12 + i]) != tolower(q[12 + i])) {
+            return -1;
+        }
+    }
+    if (memcmp(buf + 8 + qlen, q + 8 + qlen, 4)) {    // qtype、qclass
+        return -1;
+    }
+    int rcode = buf[3] & 0x0f;
+    uint16_t ancount = read16(buf + 6);
+    uint16_t nscount = read16(buf + 8);
+    size_t pos = 12 + qlen;
+    if (rcode != 0 && rcode != 3) {    // SERVFAIL/REFUSED之类的，换下一个nameserver
+        return DnsResolver::ERROR;
+    }
+
+    ttl = NO_TTL;
+    std::vector<sockaddr_storage> result;
+    for (uint32_t i = 0; i < (uint32_t)ancount + nscount; ++i) {
+        if (!skip_name(buf, len, pos) || pos + 10 > len) {
+            return -1;
+        }
+        uint16_t type = read16(buf + pos);
+        uint16_t cls = read16(buf + pos + 2);
+        uint32_t rr_ttl = read32(buf + pos + 4);
+        uint16_t rdlen = read16(buf + pos + 8);
+        pos += 10;
+        if (pos + rdlen > len) {
+            return -1;
+        }
+        const uint8_t *rdata = buf + pos;
+        if (cls == 1 && i < ancount && type == qtype) {
+            sockaddr_storage ss;
+            memset(&ss, 0, sizeof ss);
+            if (type == QTYPE_A && rdlen == 4) {
+                sockaddr_in *in = (sockaddr_in *)&ss;
+                in->sin_family = AF_INET;
+                memcpy(&in->sin_addr, rdata, 4);
+            } else if (type == QTYPE_AAAA && rdlen == 16) {
+                sockaddr_in6 *in6 = (sockaddr_in6 *)&ss;
+                in6->sin6_family = AF_INET6;
+                memcpy(&in6->sin6_addr, rdata, 16);
+            } else {
+                pos += rdlen;
+                continue;
+            }
+            result.push_back(ss);
+            ttl = std::min(ttl, rr_ttl);
+        } else if (cls == 1 && i >= ancount && type == QTYPE_SOA && result.empty()) {
+            size_t p = pos;
+            if (skip_name(buf, pos + rdlen, p) && skip_name(buf, pos + rdlen, p) && p + 20 <= pos + rdlen) {
+                ttl = std::min(rr_ttl, read32(buf + p + 16));
+            }
+        }
+        pos += rdlen;
+    }
+    if (result.empty()) {
+        return DnsResolver::NOTFOUND;
+    }
+    addrs.insert(addrs.end(), result.begin(), result.end());
+    return DnsResolver::OK;
+}
+
+DnsResolver::DnsResolver()
+{
+    loadResolvConf();
+    loadHosts();
+}
+
+bool DnsResolver::loadResolvConf(const std::string &path)
+{
+    std::vector<sockaddr_storage> servers;
+    std::vector<std::string> search;
+    uint32_t ndots = 1;
+    uint32_t timeout = 5000;
+    uint32_t attempts = 2;
+
+    std::ifstream ifs(path);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream ss(line.substr(0, line.find_first_of("#;")));
+        std::string key;
+        if (!(ss >> key)) {
+            continue;
+        }
+        std::string v;
+        if (key == "nameserver") {
+            sockaddr_storage addr;
+            if (ss >> v && servers.size() < 3 && parse_ip(v, addr, 53)) {
+                servers.push_back(addr);
+            }
+        } else if (key == "search" || key == "domain") {
+            search.clear();
+            while (ss >> v) {
+                search.push_back(to_lower(v));
+            }
+        } else if (key == "options") {
+            while (ss >> v) {
+                if (v.compare(0, 6, "ndots:") == 0) {
+                    ndots = std::min(std::max(atoi(v.c_str() + 6), 0), 15);
+                } else if (v.compare(0, 8, "timeout:") == 0) {
+                    timeout = std::max(atoi(v.c_str() + 8), 1) * 1000;
+                } else if (v.compare(0, 9, "attempts:") == 0) {
+                    attempts = std::max(atoi(v.c_str() + 9), 1);
+                }
+            }
+        }
+    }
+    if (servers.empty()) {    // 和glibc一样，没有配置的时候问本机
+        sockaddr_storage addr;
+        parse_ip("127.0.0.1", addr, 53);
+        servers.push_back(addr);
+    }
+
+    RWMutexType::WriteLock lock(m_mutex);
+    m_servers.swap(servers);
+    m_search.swap(search);
+    m_ndots = ndots;
+    m_timeout = timeout;
+    m_attempts = attempts;
+    return ifs.eof();
+}
+
+bool DnsResolver::loadHosts(const std::string &path)
+{
+    std::multimap<std::string, sockaddr_storage> hosts;
+    std::ifstream ifs(path);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream ss(line.substr(0, line.find('#')));
+        std::string ip;
+        sockaddr_storage addr;
+        if (!(ss >> ip) || !parse_ip(ip, addr, 0)) {
+            continue;
+        }
+        std::string name;
+        while (ss >> name) {
+            hosts.insert(std::make_pair(to_lower(name), addr));
+        }
+    }
+
+    RWMutexType::WriteLock lock(m_mutex);
+    m_hosts.swap(hosts);
+    return ifs.eof();
+}
+
+void DnsResolver::setServers(const std::vector<sockaddr_storage> &servers)
+{
+    RWMutexType::WriteLock lock(m_mutex);
+    m_servers = servers;
+}
+
+void DnsResolver::setTimeout(uint32_t timeout_ms, uint32_t attempts)
+{
+    RWMutexType::WriteLock lock(m_mutex);
+    m_timeout = timeout_ms;
+    m_attempts = attempts;
+}
+
+DnsResolver::Status DnsResolver::resolve(const std::string &host, std::vector<sockaddr_storage> &addrs, int family)
+{
+    sockaddr_storage ip;
+    if (parse_ip(host, ip, 0)) {
+        if (family != AF_UNSPEC && family != ip.ss_family) {
+            return NOTFOUND;
+        }
+        addrs.push_back(ip);
+        return OK;
+    }
+
+    if (host.empty()) {
+        return ERROR;
+    }
+    std::string name = to_lower(host);    // 末尾带'.'的是完整的名字，不按search展开
+    std::string hosts_name = name.back() == '.' ? name.substr(0, name.size() - 1) : name;
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        bool found = false;
+        auto range = m_hosts.equal_range(hosts_name);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (family == AF_UNSPEC || family == it->second.ss_family) {
+                addrs.push_back(it->second);
+                found = true;
+            }
+        }
+        if (found) {
+            return OK;
+        }
+    }
+
+    std::vector<int> qtypes;
+    if (family == AF_INET || family == AF_UNSPEC) {
+        qtypes.push_back(QTYPE_A);
+    }
+    if (family == AF_INET6 || family == AF_UNSPEC) {
+        qtypes.push_back(QTYPE_AAAA);
+    }
+    // 有一种查到了就算成功；都没查到的时候，超时/出错比NOTFOUND优先报
+    Status rt = qtypes.empty() ? ERROR : NOTFOUND;
+    for (int qtype : qtypes) {
+        Status s = lookup(name, qtype, addrs);
+        if (s == OK) {
+            rt = OK;
+        } else if (rt != OK && s != NOTFOUND) {
+            rt = s;
+        }
+    }
+    return rt;
+}
+
+DnsResolver::Status DnsResolver::lookup(const std::string &name, int qtype, std::vector<sockaddr_storage> &addrs)
+{
+    std::string key = name + (qtype == QTYPE_A ? "/A" : "/AAAA");
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        auto it = m_cache.find(key);
+        if (it != m_cache.end() && it->second.expire > GetMonotonicMS()) {
+            ++m_cacheHits;
+            if (it->second.status != OK) {
+                ++m_negativeHits;
+            }
+            addrs.insert(addrs.end(), it->second.addrs.begin(), it->second.addrs.end());
+            return it->second.status;
+        }
+    }
+
+    // 已经有协程在查这个名字，挂起等它的结果；不在调度器里(没法挂起)的话就自己查
+    std::shared_ptr<Pending> pending;
+    bool leader = false;
+    Scheduler *sched = Scheduler::GetThis();
+    {
+        MutexType::Lock lock(m_pendingMutex);
+        auto it = m_pending.find(key);
+        if (it == m_pending.end()) {
+            pending.reset(new Pending);
+            m_pending[key] = pending;
+            leader = true;
+        } else if (sched) {
+            pending = it->second;
+            pending->waiters.push_back(std::make_pair(sched, Fiber::GetThis()));
+        }
+    }
+    if (pending && !leader) {
+        ++m_coalesced;
+        Fiber::YieldToHold();
+        addrs.insert(addrs.end(), pending->addrs.begin(), pending->addrs.end());
+        return pending->status;
+    }
+
+    std::vector<sockaddr_storage> result;
+    uint32_t ttl = NO_TTL;
+    Status st = search(name, qtype, result, ttl);
+    if (st == OK || st == NOTFOUND) {
+        store(key, st, result, ttl);
+    }
+    if (leader) {
+        std::vector<std::pair<Scheduler *, Fiber::ptr>> waiters;
+        {
+            MutexType::Lock lock(m_pendingMutex);
+            pending->status = st;
+            pending->addrs = result;
+            waiters.swap(pending->waiters);
+            m_pending.erase(key);
+        }
+        for (auto &w : waiters) {
+            w.first->schedule(w.second);
+        }
+    }
+    addrs.insert(addrs.end(), result.begin(), result.end());
+    return st;
+}
+
+// 按resolv.conf的search/ndots展开名字，一个个试，NOTFOUND的话试下一个
+DnsResolver::Status DnsResolver::search(const std::string &name, int qtype
+        , std::vector<sockaddr_storage> &addrs, uint32_t &ttl)
+{
+    std::vector<std::string> candidates;
+    if (name.back() == '.') {
+        candidates.push_back(name.substr(0, name.size() - 1));
+    } else {
+        std::vector<std::string> suffixes;
+        uint32_t ndots = 0;
+        {
+            RWMutexType::ReadLock lock(m_mutex);
+            suffixes = m_search;
+            ndots = m_ndots;
+        }
+        bool enough_dots = (uint32_t)std::count(name.begin(), name.end(), '.') >= ndots;
+        if (enough_dots) {
+            candidates.push_back(name);
+        }
+        for (auto &s : suffixes) {
+            candidates.push_back(name + "." + s);
+        }
+        if (!enough_dots) {
+            candidates.push_back(name);
+        }
+    }
+
+    for (auto &c : candidates) {
+        uint32_t t = NO_TTL;
+        Status st = query(c, qtype, addrs, t);
+        if (st == OK) {
+            ttl = t;
+            return OK;
+        }
+        if (st != NOTFOUND) {
+            return st;
+        }
+        if (t != NO_TTL) {
+            ttl = ttl == NO_TTL ? t : std::min(ttl, t);
+        }
+    }
+    return NOTFOUND;
+}
+
+// 发一个UDP请求，按attempts轮流问每个nameserver；socket是hook过的，等回包的时候只挂起协程
+DnsResolver::Status DnsResolver::query(const std::string &name, int qtype
+        , std::vector<sockaddr_storage> &addrs, uint32_t &ttl)
+{
+    static thread_local std::mt19937 t_rng(std::random_device{}());
+    std::vector<sockaddr_storage> servers;
+    uint32_t timeout = 0;
+    uint32_t attempts = 0;
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        servers = m_servers;
+        timeout = m_timeout;
+        attempts = m_attempts;
+    }
+    if (servers.empty()) {
+        return ERROR;
+    }
+
+    uint16_t id = t_rng() & 0xffff;
+    std::string req;
+    req.push_back(id >> 8);
+    req.push_back(id & 0xff);
+    req.append("\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10);    // RD，一个问题
+    if (!encode_name(name, req)) {
+        return ERROR;
+    }
+    req.push_back(qtype >> 8);
+    req.push_back(qtype & 0xff);
+    req.append("\x00\x01", 2);    // IN
+
+    Status rt = ERROR;
+    for (uint32_t i = 0; i < attempts; ++i) {
+        for (auto &server : servers) {
+            int sock = socket(server.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (sock < 0) {
+                return ERROR;
+            }
+            // connect之后只收这个nameserver的包，对端不在的话recv会拿到ECONNREFUSED
+            if (connect(sock, (const sockaddr *)&server, addr_len(server))
+                    || send(sock, req.data(), req.size(), 0) != (ssize_t)req.size()) {
+                close(sock);
+                continue;
+            }
+            ++m_queries;
+
+            uint64_t deadline = GetMonotonicMS() + timeout;
+            int st = -1;
+            while (st < 0) {
+                uint64_t now = GetMonotonicMS();
+                if (now >= deadline) {
+                    ++m_timeouts;
+                    rt = TIMEOUT;
+                    break;
+                }
+                timeval tv = {(time_t)((deadline - now) / 1000), (suseconds_t)((deadline - now) % 1000 * 1000)};
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+                uint8_t buf[1500];
+                ssize_t n = recv(sock, buf, sizeof buf, 0);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN) {
+                        ++m_timeouts;
+                        rt = TIMEOUT;
+                    }
+                    break;
+                }
+                st = parse_response(buf, n, req, addrs, ttl);
+            }
+            close(sock);
+            if (st == OK || st == NOTFOUND) {
+                return (Status)st;
+            }
+            if (st == ERROR && rt != TIMEOUT) {
+                rt = ERROR;
+            }
+        }
+    }
+    SYLAR_LOG_DEBUG(g_logger) << "dns query " << name << " type=" << qtype << " failed status=" << rt;
+    return rt;
+}
+
+void DnsResolver::store(const std::string &key, Status status, const std::vector<sockaddr_storage> &addrs, uint32_t ttl)
+{
+    if (status == NOTFOUND && ttl == NO_TTL) {
+        ttl = g_dns_negative_ttl->getValue();
+    }
+    ttl = std::min(ttl, g_dns_max_ttl->getValue());
+    uint64_t now = GetMonotonicMS();
+    size_t cap = std::max(g_dns_cache_size->getValue(), 1u);
+
+    RWMutexType::WriteLock lock(m_mutex);
+    if (m_cache.size() >= cap) {
+        for (auto it = m_cache.begin(); it != m_cache.end();) {
+            if (it->second.expire <= now) {
+                m_cache.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        if (m_cache.size() >= cap) {
+            m_cache.erase(m_cache.begin());
+        }
+    }
+    CacheEntry &e = m_cache[key];
+    e.status = status;
+    e.addrs = addrs;
+    e.expire = now + ttl * 1000ull;
+}
+
+void DnsResolver::clearCache()
+{
+    RWMutexType::WriteLock lock(m_mutex);
+    m_cache.clear();
+}
+
+DnsResolver::Stats DnsResolver::getStats()
+{
+    Stats s;
+    s.queries = m_queries;
+    s.cacheHits = m_cacheHits;
+    s.negativeHits = m_negativeHits;
+    s.coalesced = m_coalesced;
+    s.timeouts = m_timeouts;
+    return s;
+}
+
+DnsResolver::Status resolve(const std::string &host, std::vector<sockaddr_storage> &addrs, int family)
+{
+    return DnsMgr::GetInstance()->resolve(host, addrs, family);
+}
+
+}
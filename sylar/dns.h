@@ -0,0 +1,99 @@
+#ifndef __SYLAR_DNS_H__
+#define __SYLAR_DNS_H__
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <string>
+#include <atomic>
+#include <sys/socket.h>
+#include "thread.h"
+#include "singleton.h"
+#include "fiber.h"
+
+namespace sylar {
+
+class Scheduler;
+
+// 协程里用的DNS解析：先查/etc/hosts，再用UDP直接问resolv.conf里的nameserver，
+// socket走hook，等回包的时候只挂起当前协程，不会像getaddrinfo那样把整个线程卡住
+// 结果按TTL缓存(查不到的也缓存，时间取SOA的minimum)，同一个名字同时有多个协程在查的时候只发一次请求
+class DnsResolver {
+public:
+    typedef std::shared_ptr<DnsResolver> ptr;
+    typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
+
+    enum Status {
+        OK       = 0,
+        NOTFOUND = 1,    // NXDOMAIN，或者名字存在但没有这个类型的记录
+        TIMEOUT  = 2,    // 所有nameserver都没回
+        ERROR    = 3,    // 名字不合法、SERVFAIL/REFUSED、没有nameserver等
+    };
+
+    struct Stats {
+        uint64_t queries = 0;        // 发出去的请求数(重试也算)
+        uint64_t cacheHits = 0;
+        uint64_t negativeHits = 0;   // 命中的是查不到的缓存
+        uint64_t coalesced = 0;      // 等别的协程查询结果、自己没有发请求的次数
+        uint64_t timeouts = 0;
+    };
+
+    DnsResolver();    // 加载系统的/etc/resolv.conf和/etc/hosts
+
+    // 重新加载，会替换掉原来的配置；测试的时候可以指向自己的文件
+    bool loadResolvConf(const std::string &path = "/etc/resolv.conf");
+    bool loadHosts(const std::string &path = "/etc/hosts");
+    // 直接指定nameserver(比如本地的测试DNS)，替换resolv.conf里的
+    void setServers(const std::vector<sockaddr_storage> &servers);
+    void setTimeout(uint32_t timeout_ms, uint32_t attempts);
+
+    // family: AF_INET/AF_INET6/AF_UNSPEC(两种都查)，addrs里追加结果，端口是0
+    Status resolve(const std::string &host, std::vector<sockaddr_storage> &addrs, int family = AF_INET);
+    void clearCache();
+    Stats getStats();
+private:
+    struct CacheEntry {
+        Status status;
+        std::vector<sockaddr_storage> addrs;
+        uint64_t expire;    // 单调时钟，毫秒
+    };
+    // 正在查询的名字，后来的协程挂在waiters上等结果
+    struct Pending {
+        Status status = ERROR;
+        std::vector<sockaddr_storage> addrs;
+        std::vector<std::pair<Scheduler *, Fiber::ptr>> waiters;
+    };
+
+    Status lookup(const std::string &name, int qtype, std::vector<sockaddr_storage> &addrs);
+    Status search(const std::string &name, int qtype, std::vector<sockaddr_storage> &addrs, uint32_t &ttl);
+    Status query(const std::string &name, int qtype, std::vector<sockaddr_storage> &addrs, uint32_t &ttl);
+    void store(const std::string &key, Status status, const std::vector<sockaddr_storage> &addrs, uint32_t ttl);
+private:
+    RWMutexType m_mutex;    // 配置和缓存
+    std::vector<sockaddr_storage> m_servers;
+    std::vector<std::string> m_search;
+    uint32_t m_ndots = 1;
+    uint32_t m_timeout = 5000;
+    uint32_t m_attempts = 2;
+    std::multimap<std::string, sockaddr_storage> m_hosts;
+    std::map<std::string, CacheEntry> m_cache;
+
+    MutexType m_pendingMutex;
+    std::map<std::string, std::shared_ptr<Pending>> m_pending;
+
+    std::atomic<uint64_t> m_queries = {0};
+    std::atomic<uint64_t> m_cacheHits = {0};
+    std::atomic<uint64_t> m_negativeHits = {0};
+    std::atomic<uint64_t> m_coalesced = {0};
+    std::atomic<uint64_t> m_timeouts = {0};
+};
+
+typedef Singleton<DnsResolver> DnsMgr;
+
+// 用全局的DnsResolver解析
+DnsResolver::Status resolve(const std::string &host, std::vector<sockaddr_storage> &addrs, int family = AF_INET);
+
+}
+
+#endif
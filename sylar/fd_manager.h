@@ -0,0 +1,62 @@
+#ifndef __SYLAR_FD_MANAGER_H__
+#define __SYLAR_FD_MANAGER_H__
+
+#include <memory>
+#include <vector>
+#include "thread.h"
+#include "singleton.h"
+
+namespace sylar {
+
+// 记录hook关心的fd状态：是不是socket、用户有没有自己设非阻塞、读写超时
+// socket在hook里一律被设成非阻塞(系统层面)，用户看到的阻塞/非阻塞是m_userNonblock
+class FdCtx : public std::enable_shared_from_this<FdCtx> {
+public:
+    typedef std::shared_ptr<FdCtx> ptr;
+    FdCtx(int fd);
+    ~FdCtx();
+
+    bool isInit() const { return m_isInit; }
+    bool isSocket() const { return m_isSocket; }
+    bool isDiskFile() const { return m_isDiskFile; }    // 普通文件或块设备，epoll等不了
+    bool isClose() const { return m_isClosed; }
+
+    void setUserNonblock(bool v) { m_userNonblock = v; }
+    bool getUserNonblock() const { return m_userNonblock; }
+    void setSysNonblock(bool v) { m_sysNonblock = v; }
+    bool getSysNonblock() const { return m_sysNonblock; }
+
+    // type: SO_RCVTIMEO / SO_SNDTIMEO，单位毫秒，-1是不超时
+    void setTimeout(int type, uint64_t v);
+    uint64_t getTimeout(int type);
+private:
+    bool init();
+private:
+    bool m_isInit: 1;
+    bool m_isSocket: 1;
+    bool m_isDiskFile: 1;
+    bool m_sysNonblock: 1;
+    bool m_userNonblock: 1;
+    bool m_isClosed: 1;
+    int m_fd;
+    uint64_t m_recvTimeout;
+    uint64_t m_sendTimeout;
+};
+
+class FdManager {
+public:
+    typedef RWMutex RWMutexType;
+    FdManager();
+
+    FdCtx::ptr get(int fd, bool auto_create = false);
+    void del(int fd);
+private:
+    RWMutexType m_mutex;
+    std::vector<FdCtx::ptr> m_datas;
+};
+
+typedef Singleton<FdManager> FdMgr;
+
+}
+
+#endif
@@ -0,0 +1,127 @@
+#include "file_io.h"
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+#include "scheduler.h"
+#include "util.h"
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_fileio_threads =
+    Config::Lookup<uint32_t>("fileio.threads", 4, "file io offload thread count");
+
+// 按10倍分桶: <10us, <100us, ..., <1s, 1s以上
+static int latency_bucket(uint64_t us)
+{
+    int i = 0;
+    for (uint64_t b = 10; i < 6 && us >= b; b *= 10) {
+        ++i;
+    }
+    return i;
+}
+
+FileIOPool::FileIOPool()
+{
+    uint32_t n = g_fileio_threads->getValue();
+    if (n == 0) {
+        n = 1;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        m_threads.push_back(Thread::ptr(new Thread(std::bind(&FileIOPool::worker, this)
+                        , "fileio_" + std::to_string(i))));
+    }
+    SYLAR_LOG_INFO(g_logger) << "FileIOPool threads=" << n;
+}
+
+FileIOPool::~FileIOPool()
+{
+    {
+        MutexType::Lock lock(m_mutex);
+        m_stopping = true;
+    }
+    for (size_t i = 0; i < m_threads.size(); ++i) {
+        m_sem.notify();
+    }
+    for (auto &t : m_threads) {
+        t->join();
+    }
+}
+
+void FileIOPool::run(std::function<void()> cb)
+{
+    Scheduler *sched = Scheduler::GetThis();
+    SYLAR_ASSERT(sched);
+    Fiber::ptr fiber = Fiber::GetThis();
+    ++sched->m_switchOutCount;    // 协程还要回来，调度器在这之前不能停
+
+    Task task;
+    task.cb = [cb, sched, fiber]() {
+        cb();
+        // 协程可能还没切出去，调度器会等它不是EXEC状态了再执行
+        sched->schedule(fiber);
+        --sched->m_switchOutCount;
+    };
+    task.enqueueUs = GetCurrentUS();
+    {
+        MutexType::Lock lock(m_mutex);
+        m_tasks.push_back(task);
+        ++m_stats.submitted;
+        ++m_stats.queued;
+        if (m_stats.queued > m_stats.maxQueued) {
+            m_stats.maxQueued = m_stats.queued;
+        }
+    }
+    m_sem.notify();
+    Fiber::YieldToHold();
+}
+
+void FileIOPool::addNowait()
+{
+    MutexType::Lock lock(m_mutex);
+    ++m_stats.nowait;
+}
+
+FileIOPool::Stats FileIOPool::getStats()
+{
+    MutexType::Lock lock(m_mutex);
+    return m_stats;
+}
+
+void FileIOPool::worker()
+{
+    while (true) {
+        m_sem.wait();
+        Task task;
+        uint64_t start = 0;
+        {
+            MutexType::Lock lock(m_mutex);
+            if (m_tasks.empty()) {
+                if (m_stopping) {
+                    break;
+                }
+                continue;
+            }
+            task = m_tasks.front();
+            m_tasks.pop_front();
+            start = GetCurrentUS();
+            --m_stats.queued;
+            ++m_stats.running;
+            m_stats.waitUs += start - task.enqueueUs;
+        }
+
+        uint64_t enqueue = task.enqueueUs;
+        task.cb();
+        task.cb = nullptr;
+
+        uint64_t end = GetCurrentUS();
+        MutexType::Lock lock(m_mutex);
+        --m_stats.running;
+        ++m_stats.completed;
+        m_stats.runUs += end - start;
+        ++m_stats.latency[latency_bucket(end - enqueue)];
+    }
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef __SYLAR_FILE_IO_H__
+#define __SYLAR_FILE_IO_H__
+
+#include <memory>
+#include <vector>
+#include <list>
+#include <functional>
+#include "thread.h"
+#include "singleton.h"
+
+namespace sylar {
+
+// 普通文件(磁盘)读写的线程池
+// epoll等不了普通文件，read/write/fsync直接在IOManager线程里做的话，磁盘慢起来整个线程上的网络协程都跟着卡住；
+// hook里把这些调用交给这里的线程去做，发起的协程挂起，做完了再调度回原来的调度器
+class FileIOPool {
+public:
+    typedef Mutex MutexType;
+
+    struct Stats {
+        uint64_t submitted = 0;
+        uint64_t completed = 0;
+        uint64_t nowait = 0;         // 数据在page cache里、不用offload直接读到的次数
+        uint64_t queued = 0;         // 当前排队还没被线程取走的个数
+        uint64_t maxQueued = 0;
+        uint64_t running = 0;        // 当前正在线程里执行的个数
+        uint64_t waitUs = 0;         // 排队时间总和
+        uint64_t runUs = 0;          // 执行时间总和
+        uint64_t latency[7] = {0};   // 排队+执行时间的分布: <10us, <100us, <1ms, <10ms, <100ms, <1s, 1s以上
+    };
+
+    FileIOPool();
+    ~FileIOPool();
+
+    // 在线程池里执行cb，当前协程挂起直到cb执行完，返回时回到原来的调度器上；要在调度器的协程里调用
+    void run(std::function<void()> cb);
+    void addNowait();
+    Stats getStats();
+    size_t getThreadCount() const { return m_threads.size(); }
+private:
+    struct Task {
+        std::function<void()> cb;
+        uint64_t enqueueUs;
+    };
+    void worker();
+private:
+    MutexType m_mutex;
+    Semaphore m_sem;
+    std::list<Task> m_tasks;
+    std::vector<Thread::ptr> m_threads;
+    bool m_stopping = false;
+    Stats m_stats;
+};
+
+typedef Singleton<FileIOPool> FileIOMgr;
+
+}
+
+#endif
@@ -5,20 +5,62 @@
 #include "log.h"
 #include "fiber.h"
 #include "iomanager.h"
+#include "fd_manager.h"
+#include "file_io.h"
 #include "macro.h"
 
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 namespace sylar {
 
 static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout =
     sylar::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
 
+static sylar::ConfigVar<bool>::ptr g_fileio_offload =
+    sylar::Config::Lookup("fileio.offload", true, "offload regular file io to FileIOPool");
+
 static thread_local bool t_hook_enable = false;
 
 // 因为要hook的函数比较多，而且hook的方式类似，所以我们用宏来做这个声明和定义
 #define HOOK_FUN(XX) \
     XX(sleep) \
-    XX(usleep) 
+    XX(usleep) \
+    XX(nanosleep) \
+    XX(clock_nanosleep) \
+    XX(poll) \
+    XX(select) \
+    XX(epoll_wait) \
+    XX(socket) \
+    XX(connect) \
+    XX(accept) \
+    XX(read) \
+    XX(readv) \
+    XX(recv) \
+    XX(recvfrom) \
+    XX(recvmsg) \
+    XX(recvmmsg) \
+    XX(pread) \
+    XX(write) \
+    XX(writev) \
+    XX(send) \
+    XX(sendto) \
+    XX(sendmsg) \
+    XX(sendmmsg) \
+    XX(pwrite) \
+    XX(fsync) \
+    XX(fdatasync) \
+    XX(sendfile) \
+    XX(splice) \
+    XX(tee) \
+    XX(close) \
+    XX(fcntl) \
+    XX(ioctl) \
+    XX(getsockopt) \
+    XX(setsockopt)
 
 // 要初始化hook函数
 void hook_init() {
@@ -32,6 +74,7 @@ void hook_init() {
 }
 
 static uint64_t s_connect_timeout = -1;
+static bool s_fileio_offload = true;
 struct _HookIniter {
     _HookIniter() {
         hook_init();    // 我们要确保在程序起来之前就已经hook了，所以要定义一个全局的变量
@@ -42,6 +85,13 @@ struct _HookIniter {
                                          << old_value << " to " << new_value;
                 s_connect_timeout = new_value;
         });
+
+        s_fileio_offload = g_fileio_offload->getValue();
+        g_fileio_offload->addListener([](const bool& old_value, const bool& new_value){
+                SYLAR_LOG_INFO(g_logger) << "fileio offload changed from "
+                                         << old_value << " to " << new_value;
+                s_fileio_offload = new_value;
+        });
     }
 };
 
@@ -57,6 +107,321 @@ void set_hook_enable(bool flag) {
 
 }
 
+struct timer_info {
+    int cancelled = 0;    // 被定时器取消时记下要返回的errno
+};
+
+// 不在IOManager里(比如普通的Scheduler线程)没法挂起协程，就用poll把这个线程阻塞住等，超时返回0
+static int wait_without_iomanager(int fd, uint32_t event, uint64_t timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = event == sylar::IOManager::READ ? POLLIN : POLLOUT;
+    pfd.revents = 0;
+    int rt = 0;
+    do {
+        rt = poll_f(&pfd, 1, timeout_ms == (uint64_t)-1 ? -1 : (int)timeout_ms);
+    } while (rt < 0 && errno == EINTR);
+    return rt;
+}
+
+struct poll_waiter {
+    std::atomic<bool> woken = {false};
+    sylar::Fiber::ptr fiber;
+};
+
+// poll/select/epoll_wait的公共实现：先不阻塞地poll一次，没有就绪的就给每个fd的读写各注册一个事件、
+// 再加一个超时定时器，哪个先来都把协程叫醒；醒来后把剩下的注册删掉，再不阻塞地poll一次拿到真正的revents，
+// 所以部分就绪、POLLHUP/POLLERR这些语义都和原来的poll一样。有的事件注册不上(已经有别的协程在等、EXCLUSIVE的fd等可写)，
+// 就只等注册上的，再加一个POLL_RETRY_MS的定时器醒来重新poll一次，不能把整个线程阻塞在poll里
+static const uint64_t POLL_RETRY_MS = 1;
+
+static int hook_poll(sylar::IOManager *iom, struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    uint64_t deadline = timeout < 0 ? ~0ull : sylar::GetMonotonicMS() + timeout;
+    while (true) {
+        int rt = poll_f(fds, nfds, 0);
+        if (rt != 0) {
+            return rt;
+        }
+        uint64_t now = sylar::GetMonotonicMS();
+        if (timeout == 0 || (deadline != ~0ull && now >= deadline)) {
+            return 0;
+        }
+
+        std::vector<std::pair<int, int>> regs;    // fd -> 要等的事件，同一个fd出现多次的合并掉
+        for (nfds_t i = 0; i < nfds; ++i) {
+            if (fds[i].fd < 0) {
+                continue;
+            }
+            int ev = 0;
+            if (fds[i].events & (POLLIN | POLLPRI | POLLRDNORM | POLLRDBAND)) {
+                ev |= sylar::IOManager::READ;
+            }
+            if (fds[i].events & (POLLOUT | POLLWRNORM | POLLWRBAND)) {
+                ev |= sylar::IOManager::WRITE;
+            }
+            bool merged = false;
+            for (auto &r : regs) {
+                if (r.first == fds[i].fd) {
+                    r.second |= ev;
+                    merged = true;
+                    break;
+                }
+            }
+            if (!merged) {
+                regs.push_back(std::make_pair(fds[i].fd, ev));
+            }
+        }
+
+        std::shared_ptr<poll_waiter> waiter(new poll_waiter);
+        waiter->fiber = sylar::Fiber::GetThis();
+        auto wake = [waiter, iom]() {
+            if (!waiter->woken.exchange(true)) {
+                iom->schedule(waiter->fiber);
+            }
+        };
+        std::vector<std::pair<int, sylar::IOManager::Event>> added;
+        bool failed = false;
+        for (auto &r : regs) {
+            for (sylar::IOManager::Event ev : {sylar::IOManager::READ, sylar::IOManager::WRITE}) {
+                if (!(r.second & ev)) {
+                    continue;
+                }
+                if (iom->tryAddEvent(r.first, ev, wake)) {
+                    failed = true;
+                    continue;
+                }
+                added.push_back(std::make_pair(r.first, ev));
+            }
+        }
+        uint64_t wait = deadline == ~0ull ? ~0ull : deadline - now;
+        if (failed) {
+            wait = std::min(wait, POLL_RETRY_MS);
+        }
+        sylar::Timer::ptr timer;
+        if (wait != ~0ull) {
+            sylar::TimerManager::RefreshNow();    // deadline - now是按真实时钟算的，定时器也要从真实时间算起
+            timer = iom->addTimer(wait, wake);
+        }
+
+        sylar::Fiber::YieldToHold();
+        for (auto &a : added) {
+            iom->delEvent(a.first, a.second);
+        }
+        if (timer) {
+            timer->cancle();
+        }
+        waiter->fiber.reset();
+    }
+}
+
+// 文件类型在FdCtx创建时fstat一次记下来，之后读写不用再fstat。没见过的fd先fstat一次，
+// 不是socket的才建FdCtx；socket不建，建了会被改成非阻塞、读写走协程等待，改变了调用方的语义
+static sylar::FdCtx::ptr file_ctx(int fd)
+{
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if (ctx) {
+        return ctx;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || S_ISSOCK(st.st_mode)) {
+        return nullptr;
+    }
+    return sylar::FdMgr::GetInstance()->get(fd, true);
+}
+
+// 读之前先用RWF_NOWAIT试一次，数据都在page cache里的话直接返回，省掉两次线程切换；
+// 不支持或者要等磁盘的返回-1 EAGAIN，再交给线程池
+static ssize_t read_nowait(read_fun, int fd, void *buf, size_t count)
+{
+    struct iovec iov = {buf, count};
+    return preadv2(fd, &iov, 1, -1, RWF_NOWAIT);
+}
+
+static ssize_t read_nowait(readv_fun, int fd, const struct iovec *iov, int iovcnt)
+{
+    return preadv2(fd, iov, iovcnt, -1, RWF_NOWAIT);
+}
+
+static ssize_t read_nowait(pread_fun, int fd, void *buf, size_t count, off_t offset)
+{
+    struct iovec iov = {buf, count};
+    return preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+}
+
+template<typename OriginFun, typename... Args>
+static ssize_t read_nowait(OriginFun, int, Args &&...)
+{
+    errno = EAGAIN;
+    return -1;
+}
+
+// 普通文件读写/fsync的公共实现：在IOManager的协程里调用的话交给FileIOPool的线程去做，协程挂起等结果，
+// 返回值和errno与原函数一样；不在IOManager里或者fileio.offload关掉了就直接调用原函数
+template<typename OriginFun, typename... Args>
+static ssize_t do_file_io(int fd, OriginFun fun, Args &&... args)
+{
+    if (!sylar::s_fileio_offload || !sylar::IOManager::GetThis()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+    sylar::FdCtx::ptr ctx = file_ctx(fd);
+    if (!ctx || !ctx->isDiskFile()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    ssize_t n = read_nowait(fun, fd, args...);
+    if (n >= 0) {
+        sylar::FileIOMgr::GetInstance()->addNowait();
+        return n;
+    }
+    if (errno != EAGAIN && errno != EOPNOTSUPP && errno != EINVAL) {
+        return n;
+    }
+
+    int err = 0;
+    sylar::FileIOMgr::GetInstance()->run([&]() {
+        do {
+            n = fun(fd, args...);
+        } while (n == -1 && errno == EINTR);
+        err = errno;
+    });
+    errno = err;
+    return n;
+}
+
+// 所有socket读写hook的公共实现：非阻塞地调用原函数，EAGAIN的话注册事件挂起协程，
+// 同时按SO_RCVTIMEO/SO_SNDTIMEO加一个条件定时器，超时了取消事件把协程叫醒，返回EAGAIN(和内核的超时一样)
+template<typename OriginFun, typename... Args>
+static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
+        uint32_t event, int timeout_so, Args &&... args) {
+    if (!sylar::t_hook_enable) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if (!ctx) {
+        return do_file_io(fd, fun, std::forward<Args>(args)...);
+    }
+
+    if (ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!ctx->isSocket()) {
+        return do_file_io(fd, fun, std::forward<Args>(args)...);
+    }
+
+    if (ctx->getUserNonblock()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    uint64_t to = ctx->getTimeout(timeout_so);
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+
+retry:
+    ssize_t n = fun(fd, std::forward<Args>(args)...);
+    while (n == -1 && errno == EINTR) {
+        n = fun(fd, std::forward<Args>(args)...);
+    }
+    if (n == -1 && errno == EAGAIN) {
+        sylar::IOManager *iom = sylar::IOManager::GetThis();
+        if (!iom) {
+            if (wait_without_iomanager(fd, event, to) == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            goto retry;
+        }
+
+        sylar::Timer::ptr timer;
+        std::weak_ptr<timer_info> winfo(tinfo);
+
+        if (to != (uint64_t)-1) {
+            sylar::TimerManager::RefreshNow();    // 超时从现在算，不从这一圈事件循环开始时缓存的时间算
+            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
+                auto t = winfo.lock();
+                if (!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = EAGAIN;
+                iom->cancleEvent(fd, (sylar::IOManager::Event)(event));
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
+        if (rt) {
+            SYLAR_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
+                << fd << ", " << event << ")";
+            if (timer) {
+                timer->cancle();
+            }
+            return -1;
+        } else {
+            sylar::Fiber::YieldToHold();
+            if (timer) {
+                timer->cancle();
+            }
+            if (tinfo->cancelled) {
+                errno = tinfo->cancelled;
+                return -1;
+            }
+            goto retry;
+        }
+    }
+
+    return n;
+}
+
+// splice/tee两端都可能是管道：加上SPLICE_F_NONBLOCK不阻塞地调用，EAGAIN的时候输入端还不可读就等输入端，
+// 否则就是输出端满了，等输出端；socket那一端的超时按SO_RCVTIMEO/SO_SNDTIMEO。用户自己要非阻塞的话直接调原函数
+template<typename Fun>
+static ssize_t do_pipe_io(int fd_in, int fd_out, unsigned int flags, Fun fun) {
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    if(!sylar::t_hook_enable || !iom || (flags & SPLICE_F_NONBLOCK)) {
+        return fun(flags);
+    }
+    sylar::FdCtx::ptr in_ctx = sylar::FdMgr::GetInstance()->get(fd_in);
+    sylar::FdCtx::ptr out_ctx = sylar::FdMgr::GetInstance()->get(fd_out);
+    if((in_ctx && in_ctx->isClose()) || (out_ctx && out_ctx->isClose())) {
+        errno = EBADF;
+        return -1;
+    }
+    if((in_ctx && in_ctx->getUserNonblock()) || (out_ctx && out_ctx->getUserNonblock())) {
+        return fun(flags);
+    }
+
+    while(true) {
+        ssize_t n = fun(flags | SPLICE_F_NONBLOCK);
+        if(n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+            return n;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        struct pollfd pfd = {fd_in, POLLIN, 0};
+        sylar::FdCtx::ptr ctx = in_ctx;
+        int timeout_so = SO_RCVTIMEO;
+        if(poll_f(&pfd, 1, 0) == 1) {
+            pfd.fd = fd_out;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            ctx = out_ctx;
+            timeout_so = SO_SNDTIMEO;
+        }
+        uint64_t to = ctx ? ctx->getTimeout(timeout_so) : (uint64_t)-1;
+        int rt = hook_poll(iom, &pfd, 1, to == (uint64_t)-1 ? -1 : (int)to);
+        if(rt < 0) {
+            return rt;
+        }
+        if(rt == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
 // 声明函数指针类型
 extern "C" {
 #define XX(name) name ## _fun name ## _f = nullptr;
@@ -71,10 +436,14 @@ unsigned int sleep(unsigned int seconds) {
     // 我们自己的实现
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();     // 取出当前协程
     sylar::IOManager* iom = sylar::IOManager::GetThis();   // 取出当前iomanager
+    if (!iom) {
+        return sleep_f(seconds);    // 普通的Scheduler里没有定时器，只能真的睡
+    }
     // 在当前iomanager中加个定时器
     // iom->addTimer(seconds * 1000, std::bind((void(sylar::Scheduler::*)     
     //         (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule
     //         ,iom, fiber, -1));
+    sylar::TimerManager::RefreshNow();    // 前面的任务可能跑了很久，缓存的时间旧了，睡的时间要从现在算
     iom->addTimer(seconds * 1000, [iom, fiber](){
         iom->schedule(fiber);
     });
@@ -88,14 +457,540 @@ int usleep(useconds_t usec) {
     }
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
     sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if (!iom) {
+        return usleep_f(usec);
+    }
     // iom->addTimer(usec / 1000, std::bind((void(sylar::Scheduler::*)
     //         (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule
     //         ,iom, fiber, -1));
-    iom->addTimer(usec / 1000, [iom, fiber](){
+    sylar::TimerManager::RefreshNow();
+    iom->addTimerUs(usec, [iom, fiber](){
         iom->schedule(fiber);
     });
     sylar::Fiber::YieldToHold();
     return 0;
 }
 
-}
\ No newline at end of file
+// 微秒定时器，不足1微秒的按1微秒算
+static int hook_sleep_us(sylar::IOManager *iom, uint64_t us)
+{
+    sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
+    sylar::TimerManager::RefreshNow();
+    iom->addTimerUs(us, [iom, fiber](){
+        iom->schedule(fiber);
+    });
+    sylar::Fiber::YieldToHold();
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!sylar::t_hook_enable || !iom) {
+        return nanosleep_f(req, rem);
+    }
+    if(!req || req->tv_nsec < 0 || req->tv_nsec >= 1000000000 || req->tv_sec < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t us = req->tv_sec * 1000000 + (req->tv_nsec + 999) / 1000;
+    if(us) {
+        hook_sleep_us(iom, us);
+    } else {
+        sylar::Fiber::YieldToReady();
+    }
+    if(rem) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    return 0;
+}
+
+// 只接管CLOCK_REALTIME/CLOCK_MONOTONIC，其他时钟(比如cpu时间)交给原函数；注意它出错时返回错误码而不是设置errno
+int clock_nanosleep(clockid_t clockid, int flags, const struct timespec *req, struct timespec *rem) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!sylar::t_hook_enable || !iom || (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)) {
+        return clock_nanosleep_f(clockid, flags, req, rem);
+    }
+    if(!req || req->tv_nsec < 0 || req->tv_nsec >= 1000000000 || req->tv_sec < 0) {
+        return EINVAL;
+    }
+    int64_t ns = req->tv_sec * 1000000000ll + req->tv_nsec;
+    if(flags & TIMER_ABSTIME) {
+        struct timespec now;
+        clock_gettime(clockid, &now);
+        ns -= now.tv_sec * 1000000000ll + now.tv_nsec;
+        if(ns <= 0) {
+            return 0;
+        }
+    } else if(rem) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    uint64_t us = (ns + 999) / 1000;
+    if(us) {
+        hook_sleep_us(iom, us);
+    } else {
+        sylar::Fiber::YieldToReady();
+    }
+    return 0;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!sylar::t_hook_enable || !iom) {
+        return poll_f(fds, nfds, timeout);
+    }
+    return hook_poll(iom, fds, nfds, timeout);
+}
+
+// 转成pollfd走hook_poll，再把结果填回fd_set；和Linux一样，timeout会被改成剩下的时间
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!sylar::t_hook_enable || !iom) {
+        return select_f(nfds, readfds, writefds, exceptfds, timeout);
+    }
+    if(nfds < 0 || nfds > FD_SETSIZE || (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0))) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::vector<struct pollfd> pfds;
+    for(int fd = 0; fd < nfds; ++fd) {
+        short events = 0;
+        if(readfds && FD_ISSET(fd, readfds)) {
+            events |= POLLIN;
+        }
+        if(writefds && FD_ISSET(fd, writefds)) {
+            events |= POLLOUT;
+        }
+        if(exceptfds && FD_ISSET(fd, exceptfds)) {
+            events |= POLLPRI;
+        }
+        if(events) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = events;
+            pfd.revents = 0;
+            pfds.push_back(pfd);
+        }
+    }
+    int ms = timeout ? (int)(timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000) : -1;
+    uint64_t start = sylar::GetMonotonicMS();
+    int rt = hook_poll(iom, pfds.empty() ? nullptr : &pfds[0], pfds.size(), ms);
+    if(rt < 0) {
+        return rt;
+    }
+    if(timeout) {
+        int64_t left = ms - (int64_t)(sylar::GetMonotonicMS() - start);
+        left = left > 0 ? left : 0;
+        timeout->tv_sec = left / 1000;
+        timeout->tv_usec = left % 1000 * 1000;
+    }
+    for(auto &pfd : pfds) {
+        if(pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+    if(readfds) {
+        FD_ZERO(readfds);
+    }
+    if(writefds) {
+        FD_ZERO(writefds);
+    }
+    if(exceptfds) {
+        FD_ZERO(exceptfds);
+    }
+    int count = 0;
+    for(auto &pfd : pfds) {
+        if(readfds && (pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(pfd.fd, readfds);
+            ++count;
+        }
+        if(writefds && (pfd.events & POLLOUT) && (pfd.revents & (POLLOUT | POLLERR))) {
+            FD_SET(pfd.fd, writefds);
+            ++count;
+        }
+        if(exceptfds && (pfd.events & POLLPRI) && (pfd.revents & POLLPRI)) {
+            FD_SET(pfd.fd, exceptfds);
+            ++count;
+        }
+    }
+    return count;
+}
+
+// 第三方库自己的epoll：epoll fd本身可读就说明里面有事件，等它可读再不阻塞地取
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!sylar::t_hook_enable || !iom) {
+        return epoll_wait_f(epfd, events, maxevents, timeout);
+    }
+    uint64_t deadline = timeout < 0 ? ~0ull : sylar::GetMonotonicMS() + timeout;
+    while(true) {
+        int rt = epoll_wait_f(epfd, events, maxevents, 0);
+        if(rt != 0) {
+            return rt;
+        }
+        uint64_t now = sylar::GetMonotonicMS();
+        if(timeout == 0 || (deadline != ~0ull && now >= deadline)) {
+            return 0;
+        }
+        struct pollfd pfd;
+        pfd.fd = epfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        rt = hook_poll(iom, &pfd, 1, deadline == ~0ull ? -1 : (int)(deadline - now));
+        if(rt < 0) {
+            return rt;
+        }
+    }
+}
+
+int socket(int domain, int type, int protocol) {
+    if(!sylar::t_hook_enable) {
+        return socket_f(domain, type, protocol);
+    }
+    int fd = socket_f(domain, type, protocol);
+    if(fd == -1) {
+        return fd;
+    }
+    sylar::FdMgr::GetInstance()->del(fd);    // 新分配的号，表里还有的话是之前没经过hook关掉的，已经过时了
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd, true);
+    if(type & SOCK_NONBLOCK) {
+        ctx->setUserNonblock(true);
+    }
+    return fd;
+}
+
+int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen, uint64_t timeout_ms) {
+    if(!sylar::t_hook_enable) {
+        return connect_f(fd, addr, addrlen);
+    }
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+        return connect_f(fd, addr, addrlen);
+    }
+
+    int n = connect_f(fd, addr, addrlen);
+    if(n == 0) {
+        return 0;
+    } else if(n != -1 || errno != EINPROGRESS) {
+        return n;
+    }
+
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    if(!iom) {
+        if(wait_without_iomanager(fd, sylar::IOManager::WRITE, timeout_ms) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    } else {
+        sylar::Timer::ptr timer;
+        std::shared_ptr<timer_info> tinfo(new timer_info);
+        std::weak_ptr<timer_info> winfo(tinfo);
+
+        if(timeout_ms != (uint64_t)-1) {
+            sylar::TimerManager::RefreshNow();
+            timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
+                auto t = winfo.lock();
+                if(!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = ETIMEDOUT;
+                iom->cancleEvent(fd, sylar::IOManager::WRITE);
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
+        if(rt == 0) {
+            sylar::Fiber::YieldToHold();
+            if(timer) {
+                timer->cancle();
+            }
+            if(tinfo->cancelled) {
+                errno = tinfo->cancelled;
+                return -1;
+            }
+        } else {
+            if(timer) {
+                timer->cancle();
+            }
+            SYLAR_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+        }
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if(-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        return -1;
+    }
+    if(!error) {
+        return 0;
+    } else {
+        errno = error;
+        return -1;
+    }
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    return connect_with_timeout(sockfd, addr, addrlen, sylar::s_connect_timeout);
+}
+
+int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
+    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    if(fd >= 0 && sylar::t_hook_enable) {
+        sylar::FdMgr::GetInstance()->del(fd);
+        sylar::FdMgr::GetInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
+}
+
+// 非阻塞的socket上recvmmsg拿到第一个报文以后不会再等，所以是 等到有报文 + 一次把已经到了的都取走
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+    return do_io(sockfd, recvmmsg_f, "recvmmsg", sylar::IOManager::READ, SO_RCVTIMEO, msgvec, vlen, flags, timeout);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    if(!sylar::t_hook_enable) {
+        return pread_f(fd, buf, count, offset);
+    }
+    return do_file_io(fd, pread_f, buf, count, offset);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+}
+
+ssize_t send(int s, const void *msg, size_t len, int flags) {
+    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+}
+
+ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+}
+
+ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    return do_io(sockfd, sendmmsg_f, "sendmmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msgvec, vlen, flags);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    if(!sylar::t_hook_enable) {
+        return pwrite_f(fd, buf, count, offset);
+    }
+    return do_file_io(fd, pwrite_f, buf, count, offset);
+}
+
+int fsync(int fd) {
+    if(!sylar::t_hook_enable) {
+        return fsync_f(fd);
+    }
+    return do_file_io(fd, fsync_f);
+}
+
+int fdatasync(int fd) {
+    if(!sylar::t_hook_enable) {
+        return fdatasync_f(fd);
+    }
+    return do_file_io(fd, fdatasync_f);
+}
+
+// sendfile只会在输出的socket写满的时候EAGAIN，按write处理
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    return do_io(out_fd, sendfile_f, "sendfile", sylar::IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    return do_pipe_io(fd_in, fd_out, flags, [=](unsigned int f) {
+        return splice_f(fd_in, off_in, fd_out, off_out, len, f);
+    });
+}
+
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    return do_pipe_io(fd_in, fd_out, flags, [=](unsigned int f) {
+        return tee_f(fd_in, fd_out, len, f);
+    });
+}
+
+int close(int fd) {
+    if(!sylar::t_hook_enable) {
+        return close_f(fd);
+    }
+
+    // 没有FdCtx的fd(pipe、eventfd，经poll等过的第三方fd)也可能在IOManager里注册过，一样要清掉，
+    // 不然PERSIST模式下留着registered，这个号复用以后就加不进epoll了；查表不加锁，没注册过的很便宜
+    auto iom = sylar::IOManager::GetThis();
+    if(iom) {
+        iom->cancleAllEvent(fd);    // 等在这个fd上的协程都叫醒，它们重试时会拿到EBADF
+    }
+    if(sylar::FdMgr::GetInstance()->get(fd)) {
+        sylar::FdMgr::GetInstance()->del(fd);
+    }
+    return close_f(fd);
+}
+
+// 用户设置的O_NONBLOCK记在FdCtx里，socket在系统层面始终是非阻塞的；F_GETFL返回用户看到的状态
+int fcntl(int fd, int cmd, ... /* arg */ ) {
+    va_list va;
+    va_start(va, cmd);
+    switch(cmd) {
+        case F_SETFL:
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+                if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                    return fcntl_f(fd, cmd, arg);
+                }
+                ctx->setUserNonblock(arg & O_NONBLOCK);
+                if(ctx->getSysNonblock()) {
+                    arg |= O_NONBLOCK;
+                } else {
+                    arg &= ~O_NONBLOCK;
+                }
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        case F_GETFL:
+            {
+                va_end(va);
+                int arg = fcntl_f(fd, cmd);
+                sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+                if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                    return arg;
+                }
+                if(ctx->getUserNonblock()) {
+                    return arg | O_NONBLOCK;
+                } else {
+                    return arg & ~O_NONBLOCK;
+                }
+            }
+            break;
+        case F_DUPFD:
+        case F_DUPFD_CLOEXEC:
+        case F_SETFD:
+        case F_SETOWN:
+        case F_SETSIG:
+        case F_SETLEASE:
+        case F_NOTIFY:
+#ifdef F_SETPIPE_SZ
+        case F_SETPIPE_SZ:
+#endif
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg); 
+            }
+            break;
+        case F_GETFD:
+        case F_GETOWN:
+        case F_GETSIG:
+        case F_GETLEASE:
+#ifdef F_GETPIPE_SZ
+        case F_GETPIPE_SZ:
+#endif
+            {
+                va_end(va);
+                return fcntl_f(fd, cmd);
+            }
+            break;
+        case F_SETLK:
+        case F_SETLKW:
+        case F_GETLK:
+            {
+                struct flock *arg = va_arg(va, struct flock *);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        case F_GETOWN_EX:
+        case F_SETOWN_EX:
+            {
+                struct f_owner_exlock *arg = va_arg(va, struct f_owner_exlock *);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        default:
+            {
+                // 其他命令的参数都是一个指针大小的值，原样传下去
+                void *arg = va_arg(va, void *);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+    }
+}
+
+int ioctl(int d, unsigned long int request, ...) {
+    va_list va;
+    va_start(va, request);
+    void *arg = va_arg(va, void *);
+    va_end(va);
+
+    if(FIONBIO == request) {
+        bool user_nonblock = !!*(int *)arg;
+        sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(d);
+        if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+            return ioctl_f(d, request, arg);
+        }
+        ctx->setUserNonblock(user_nonblock);
+        return 0;    // 系统层面保持非阻塞，不用真的调用
+    }
+    return ioctl_f(d, request, arg);
+}
+
+int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    return getsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+// SO_RCVTIMEO/SO_SNDTIMEO除了设到内核里，还要记到FdCtx里，挂起协程的时候用它当超时
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    if(!sylar::t_hook_enable) {
+        return setsockopt_f(sockfd, level, optname, optval, optlen);
+    }
+    if(level == SOL_SOCKET) {
+        // 长度不够的不记，原样交给系统调用，由它返回EINVAL/EFAULT
+        if((optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) && optval && optlen >= sizeof(timeval)) {
+            sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(sockfd);
+            if(ctx) {
+                const timeval *v = (const timeval *)optval;
+                uint64_t ms = v->tv_sec * 1000 + v->tv_usec / 1000;
+                ctx->setTimeout(optname, ms ? ms : (uint64_t)-1);    // 0表示不超时
+            }
+        }
+    }
+    return setsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+}
@@ -1,8 +1,15 @@
 #include "iomanager.h"
+#include "config.h"
+#include "hook.h"
 #include "log.h"
 #include "macro.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -12,6 +19,145 @@ namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+static sylar::ConfigVar<std::string>::ptr g_iomanager_backend =
+    sylar::Config::Lookup<std::string>("iomanager.backend", "epoll", "iomanager backend: epoll or io_uring");
+
+// 每个线程一个epoll(多reactor)，fd注册在注册它的线程上(不是本IOManager的线程就按fd哈希)，事件只在这个线程上处理
+static sylar::ConfigVar<bool>::ptr g_iomanager_per_thread_epoll =
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll", false, "iomanager one epoll per thread");
+
+// 低延迟模式：这么多个线程在idle里用epoll_wait(timeout=0)空转，拿cpu换掉睡眠唤醒的延迟
+static sylar::ConfigVar<uint32_t>::ptr g_iomanager_busy_poll_threads =
+    sylar::Config::Lookup<uint32_t>("iomanager.busy_poll_threads", 0, "iomanager busy poll threads");
+
+static sylar::ConfigVar<int>::ptr g_iomanager_so_busy_poll =
+    sylar::Config::Lookup<int>("iomanager.so_busy_poll", 0, "SO_BUSY_POLL usec for sockets in busy poll mode");
+
+// 没有单独设置过的fd在epoll里的注册方式: edge, oneshot, persist
+static sylar::ConfigVar<std::string>::ptr g_iomanager_event_mode =
+    sylar::Config::Lookup<std::string>("iomanager.event_mode", "edge", "iomanager default fd event mode: edge, oneshot or persist");
+
+// 小的发送拷贝比注册页面+收完成通知便宜，这个大小以下的sendZeroCopy直接拷贝
+static sylar::ConfigVar<uint32_t>::ptr g_iomanager_zerocopy_min_size =
+    sylar::Config::Lookup<uint32_t>("iomanager.zerocopy_min_size", 16384, "sendZeroCopy below this size copies instead");
+
+// 事件循环的统计(每个线程的epoll_wait时间、事件数、定时器延迟、协程运行时间、tickle次数)，打开后每轮循环多几次取时间
+static sylar::ConfigVar<bool>::ptr g_iomanager_loop_stats =
+    sylar::Config::Lookup<bool>("iomanager.loop_stats", false, "iomanager collect per thread event loop stats");
+
+// addSignal注册过的信号: 处理函数置位s_caught_signals并写注册它的IOManager的m_signalWakeFd
+static const int MAX_SIGNAL = 64;
+static std::atomic<uint64_t> s_caught_signals = {0};
+static std::atomic<int> s_signal_wake_fds[MAX_SIGNAL + 1];
+static struct sigaction s_old_actions[MAX_SIGNAL + 1];
+
+// 信号落在了没屏蔽它的线程上(线程早于addSignal创建，或者协程切换恢复了旧的信号屏蔽字)，转交给事件循环
+static void forward_signal(int signo)
+{
+    int saved = errno;
+    s_caught_signals.fetch_or(1ull << (signo - 1));
+    int fd = s_signal_wake_fds[signo].load();
+    if (fd >= 0) {
+        eventfd_write(fd, 1);
+    }
+    errno = saved;
+}
+
+static thread_local IOManager *t_reactor_iom = nullptr;
+static thread_local int t_reactor_index = -1;
+// 当前线程正在这个IOManager的idle里调度到期定时器的回调，调度完马上回run里取任务，不用唤醒自己
+static thread_local IOManager *t_timer_iom = nullptr;
+
+static sylar::ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+    sylar::Config::Lookup<uint32_t>("iomanager.uring_entries", 4096, "io_uring submission queue entries");
+
+// io_uring的user_data: 低3位是类型，READ/WRITE是addEvent注册的poll，高位是 状态字<<32 | fd<<3
+// URING_OP是asyncRead等直接提交的操作，高位是UringCompletion的地址；0是NOP/POLL_REMOVE这类不关心结果的
+static const uint64_t URING_TAG_MASK = 0x7;
+static const uint64_t URING_OP = 0x2;
+
+// 直接提交的操作在协程栈上放一个这个，完成时填结果并恢复协程
+struct UringCompletion {
+    Scheduler *scheduler;
+    Fiber::ptr fiber;
+    int res;
+};
+
+static uint64_t uring_poll_data(int fd, IOManager::Event event, uint32_t state)
+{
+    return ((uint64_t)state << 32) | ((uint64_t)fd << 3) | event;
+}
+
+// 单写者的计数，不需要原子加
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t v)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// 每个线程一份，只有所属线程写，getLoopStats在别的线程读
+struct IOManager::LoopCounters {
+    struct Histogram {
+        std::atomic<uint64_t> count = {0};
+        std::atomic<uint64_t> sum = {0};
+        std::atomic<uint64_t> max = {0};
+        std::atomic<uint64_t> buckets[LoopHistogram::BUCKETS];
+
+        Histogram() {
+            for (auto &i : buckets) {
+                i = 0;
+            }
+        }
+        void add(uint64_t v) {
+            int b = v ? 64 - __builtin_clzll(v) : 0;
+            bump(buckets[b < LoopHistogram::BUCKETS ? b : LoopHistogram::BUCKETS - 1], 1);
+            bump(count, 1);
+            bump(sum, v);
+            if (v > max.load(std::memory_order_relaxed)) {
+                max.store(v, std::memory_order_relaxed);
+            }
+        }
+        void read(LoopHistogram &h) const {
+            h.count = count.load(std::memory_order_relaxed);
+            h.sum = sum.load(std::memory_order_relaxed);
+            h.max = max.load(std::memory_order_relaxed);
+            for (int i = 0; i < LoopHistogram::BUCKETS; ++i) {
+                h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    int threadId = 0;
+    std::atomic<uint64_t> loops = {0};
+    std::atomic<uint64_t> tickleWakeups = {0};
+    Histogram waitUs;
+    Histogram events;
+    Histogram timerLagUs;
+    Histogram runUs;
+};
+
+void IOManager::LoopHistogram::merge(const LoopHistogram &other)
+{
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+uint64_t IOManager::LoopHistogram::percentile(double p) const
+{
+    uint64_t target = (uint64_t)(count * p + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS - 1; ++i) {
+        seen += buckets[i];
+        if (seen >= target && seen) {
+            return std::min<uint64_t>(i ? (1ull << i) - 1 : 0, max);
+        }
+    }
+    return max;
+}
+
 IOManager::FdContext::EventContext &IOManager::FdContext::getContext(Event event)
 {
     switch (event) {
@@ -24,49 +170,134 @@ IOManager::FdContext::EventContext &IOManager::FdContext::getContext(Event event
     }
 }
 
-void IOManager::FdContext::resetContext(EventContext &ctx)
+int IOManager::FdContext::armedEvents()
+{
+    int events = NONE;
+    if ((read.state.load(std::memory_order_acquire) & STATE_MASK) == ARMED) {
+        events |= READ;
+    }
+    if ((write.state.load(std::memory_order_acquire) & STATE_MASK) == ARMED) {
+        events |= WRITE;
+    }
+    return events;
+}
+
+uint32_t IOManager::FdContext::claim(Event event, uint32_t expect)
+{
+    EventContext &ctx = getContext(event);
+    uint32_t state = expect ? expect : ctx.state.load(std::memory_order_acquire);
+    if ((state & STATE_MASK) != ARMED) {
+        return 0;
+    }
+    if (!ctx.state.compare_exchange_strong(state, (state & ~STATE_MASK) | FIRING, std::memory_order_acq_rel)) {
+        return 0;
+    }
+    return state;
+}
+
+bool IOManager::FdContext::fire(Event event)
+{
+    EventContext &ctx = getContext(event);
+    uint32_t state = ctx.state.load(std::memory_order_acquire);
+    while (true) {
+        if ((state & STATE_MASK) == ARMED) {
+            if (ctx.state.compare_exchange_weak(state, (state & ~STATE_MASK) | FIRING, std::memory_order_acq_rel)) {
+                triggerEvent(event);
+                return true;
+            }
+            continue;
+        }
+        // 没人在等: EDGE/ONESHOT直接丢掉(重新注册时epoll_ctl会重新检查一次)，PERSIST/EXCLUSIVE不会再epoll_ctl了，要记下来
+        if (!latched() || (state & PENDING)) {
+            return false;
+        }
+        if (ctx.state.compare_exchange_weak(state, state | PENDING, std::memory_order_acq_rel)) {
+            return false;
+        }
+    }
+}
+
+// 只清状态位，抢到之后新来的PENDING要留着
+void IOManager::FdContext::resetContext(Event event)
 {
+    EventContext &ctx = getContext(event);
     ctx.scheduler = nullptr;
     ctx.fiber.reset();
     ctx.cb = nullptr;
+    ctx.state.fetch_and(~STATE_MASK, std::memory_order_release);
 }
 
 void IOManager::FdContext::triggerEvent(Event event)
 {
-    SYLAR_ASSERT(events & event);
-    events = (Event)(events & ~event);
     EventContext &ctx = getContext(event);
-    if (ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
+    Scheduler *scheduler = ctx.scheduler;
+    Fiber::ptr fiber;
+    std::function<void()> cb;
+    fiber.swap(ctx.fiber);
+    cb.swap(ctx.cb);
+    ctx.scheduler = nullptr;
+    // 先回到IDLE再调度，协程一恢复就可能马上重新注册
+    ctx.state.fetch_and(~STATE_MASK, std::memory_order_release);
+    if (cb) {
+        scheduler->schedule(&cb);
     } else {
-        ctx.scheduler->schedule(&ctx.fiber);
+        scheduler->schedule(&fiber);
     }
-    ctx.scheduler = nullptr;
-    return;
 }
 
 IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
     : Scheduler(threads, use_caller, name)
 {
-    m_epfd = epoll_create(5000);
-    SYLAR_ASSERT(m_epfd > 0);
+    size_t reactors = 1;
+    if (g_iomanager_per_thread_epoll->getValue()) {
+        reactors = m_threadCount + (m_rootThreadId != -1 ? 1 : 0);
+    }
+    for (size_t i = 0; i < reactors; ++i) {
+        Reactor *r = new Reactor;
+        r->epfd = epoll_create(5000);
+        SYLAR_ASSERT(r->epfd > 0);
 
-    int rt = pipe(m_tickleFds);
-    SYLAR_ASSERT(!rt);
+        r->tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(r->tickleFd >= 0);
 
-    epoll_event event;
-    memset(&event, 0, sizeof event);
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
+        epoll_event event;
+        memset(&event, 0, sizeof event);
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = r->tickleFd;
 
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    SYLAR_ASSERT(!rt);
+        int rt = epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->tickleFd, &event);
+        SYLAR_ASSERT(!rt);
+        m_reactors.push_back(r);
+    }
 
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    SYLAR_ASSERT(!rt);
+    for (auto &i : m_fdChunks) {
+        i = nullptr;
+    }
 
-    // m_fdContexts.resize(32);
-    contextResize(32);
+    m_busyPollThreads = g_iomanager_busy_poll_threads->getValue();
+    m_soBusyPoll = g_iomanager_so_busy_poll->getValue();
+    m_zeroCopyMinSize = g_iomanager_zerocopy_min_size->getValue();
+    const std::string &mode = g_iomanager_event_mode->getValue();
+    if (mode == "oneshot") {
+        m_defaultEventMode = ONESHOT;
+    } else if (mode == "persist") {
+        m_defaultEventMode = PERSIST;
+    } else if (mode == "exclusive") {
+        m_defaultEventMode = EXCLUSIVE;
+    }
+    for (auto &i : m_pollBatch) {
+        i = 0;
+    }
+    m_loopStats = g_iomanager_loop_stats->getValue();
+
+    if (g_iomanager_backend->getValue() == "io_uring") {
+        m_uring = IOUring::Create(g_iomanager_uring_entries->getValue());
+        if (!m_uring) {
+            SYLAR_LOG_ERROR(g_logger) << "name=" << getName() << " io_uring unavailable, fallback to epoll";
+        }
+    }
+    // 每个Reactor一个定时器队列，线程只处理自己的；io_uring只有一个事件循环，只要一个
+    setTimerQueues(m_uring ? 1 : m_reactors.size());
 
     start();
 }
@@ -74,62 +305,111 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
 IOManager::~IOManager()
 {
     stop();
-    close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    for (auto r : m_reactors) {
+        close(r->epfd);
+        close(r->tickleFd);
+        delete r;
+    }
 
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (m_fdContexts[i]) {
-            delete m_fdContexts[i];
+    for (auto &i : m_fdChunks) {
+        std::atomic<FdContext *> *chunk = i;
+        if (!chunk) {
+            continue;
+        }
+        for (int j = 0; j < FD_CHUNK_SIZE; ++j) {
+            delete chunk[j].load();
         }
+        delete[] chunk;
+    }
+    for (auto c : m_loopCounters) {
+        delete c;
+    }
+    while (!m_signals.empty()) {
+        delSignal(m_signals.begin()->first);
+    }
+    if (m_signalFd >= 0) {
+        close(m_signalFd);
+        close(m_signalWakeFd);
     }
 }
 
-void IOManager::contextResize(size_t size)
+IOManager::FdContext *IOManager::getFdContext(int fd, bool auto_create)
 {
-    m_fdContexts.resize(size);
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (!m_fdContexts[i]) {
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
+    if (fd < 0 || fd >= FD_CHUNK_COUNT * FD_CHUNK_SIZE) {
+        return nullptr;
+    }
+    std::atomic<FdContext *> *chunk = m_fdChunks[fd >> FD_CHUNK_SHIFT].load(std::memory_order_acquire);
+    if (!chunk) {
+        if (!auto_create) {
+            return nullptr;
+        }
+        std::atomic<FdContext *> *new_chunk = new std::atomic<FdContext *>[FD_CHUNK_SIZE];
+        for (int i = 0; i < FD_CHUNK_SIZE; ++i) {
+            new_chunk[i] = nullptr;
+        }
+        // 多个线程同时分配同一块，只有一个能放进去，其他的删掉自己的用它的
+        if (m_fdChunks[fd >> FD_CHUNK_SHIFT].compare_exchange_strong(chunk, new_chunk, std::memory_order_acq_rel)) {
+            chunk = new_chunk;
+        } else {
+            delete[] new_chunk;
+        }
+    }
+    std::atomic<FdContext *> &slot = chunk[fd & (FD_CHUNK_SIZE - 1)];
+    FdContext *fd_ctx = slot.load(std::memory_order_acquire);
+    if (!fd_ctx && auto_create) {
+        FdContext *new_ctx = new FdContext;
+        new_ctx->fd = fd;
+        new_ctx->mode = m_defaultEventMode;
+        if (slot.compare_exchange_strong(fd_ctx, new_ctx, std::memory_order_acq_rel)) {
+            fd_ctx = new_ctx;
+        } else {
+            delete new_ctx;
         }
     }
+    return fd_ctx;
 }
 
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
 {
-    FdContext *fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock(m_mutex);
-        contextResize(fd * 1.5);     // 不能以m_fdContexts.size() * 1.5
-        fd_ctx = m_fdContexts[fd];
-    }
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (fd_ctx->events & event) {
-        SYLAR_LOG_INFO(g_logger) << "addEvent assert fd=" << fd << " event=" << event << " fd_ctx.event=" << fd_ctx->events;
-        SYLAR_ASSERT(!(fd_ctx->events & event));
-    }
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    return armEvent(fd, event, std::move(cb), false);
+}
+
+int IOManager::tryAddEvent(int fd, Event event, std::function<void()> cb)
+{
+    return armEvent(fd, event, std::move(cb), true);
+}
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);    // 把事件加到epoll里面去了
-    if (rt) {
-        SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << ", " << fd << ", " << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+int IOManager::armEvent(int fd, Event event, std::function<void()> &&cb, bool try_only)
+{
+    FdContext *fd_ctx = getFdContext(fd, true);
+    if (!fd_ctx) {
+        SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+        errno = EBADF;
+        return -1;
+    }
+    if (!m_uring && fd_ctx->mode == EXCLUSIVE && event != READ) {
+        SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " event=" << event << " exclusive fd only supports READ";
+        errno = EINVAL;
         return -1;
     }
-    
-    ++m_pendingEventCount;
-    fd_ctx->events = (Event)(fd_ctx->events | event);
     FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+    uint32_t state = event_ctx.state.load(std::memory_order_acquire);
+    while (true) {
+        if ((state & FdContext::STATE_MASK) != FdContext::IDLE) {
+            if (try_only) {
+                errno = EBUSY;
+                return -1;
+            }
+            SYLAR_LOG_INFO(g_logger) << "addEvent assert fd=" << fd << " event=" << event << " state=" << state;
+            SYLAR_ASSERT2(false, "addEvent");
+        }
+        uint32_t arming = ((state & ~(FdContext::GEN_STEP - 1)) + FdContext::GEN_STEP)
+            | (state & FdContext::PENDING) | FdContext::ARMING;
+        if (event_ctx.state.compare_exchange_weak(state, arming, std::memory_order_acq_rel)) {
+            state = arming;
+            break;
+        }
+    }
     SYLAR_ASSERT(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
 
     event_ctx.scheduler = Scheduler::GetThis();
@@ -139,116 +419,256 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
         event_ctx.fiber = Fiber::GetThis();
         SYLAR_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
     }
-    return 0;
+    ++m_pendingEventCount;
+
+    // 先置成ARMED再交给内核，这样事件一来就能被触发；交给内核失败的话再把它抢回来
+    // PERSIST/EXCLUSIVE模式下注册之前事件已经来过了(PENDING)，就不等了，直接触发
+    bool try_add = !fd_ctx->armedEvents();
+    uint32_t armed = 0;
+    while (true) {
+        if (state & FdContext::PENDING) {
+            if (event_ctx.state.compare_exchange_weak(state
+                        , (state & ~(FdContext::STATE_MASK | FdContext::PENDING)) | FdContext::FIRING
+                        , std::memory_order_acq_rel)) {
+                fd_ctx->triggerEvent(event);
+                --m_pendingEventCount;
+                return 0;
+            }
+            continue;
+        }
+        armed = (state & ~FdContext::STATE_MASK) | FdContext::ARMED;
+        if (event_ctx.state.compare_exchange_weak(state, armed, std::memory_order_acq_rel)) {
+            break;
+        }
+    }
+    bool ok = false;
+    if (m_uring) {
+        ok = uringPollAdd(fd_ctx, event, armed);
+    } else {
+        int owner = -1;
+        if (fd_ctx->owner.compare_exchange_strong(owner, pickOwner(fd))) {
+            if (m_busyPollThreads && m_soBusyPoll > 0) {    // 不是socket或者没权限都会失败，不影响注册
+                setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &m_soBusyPoll, sizeof m_soBusyPoll);
+            }
+        }
+        switch (fd_ctx->mode) {
+            case ONESHOT:
+                ok = syncEpoll(fd_ctx, !fd_ctx->registered);
+                if (ok) {
+                    fd_ctx->registered = true;
+                }
+                break;
+            case PERSIST:
+            case EXCLUSIVE:
+                ok = epollRegister(fd_ctx);
+                break;
+            default:
+                ok = syncEpoll(fd_ctx, try_add);
+                break;
+        }
+    }
+    if (!ok && fd_ctx->claim(event, armed)) {
+        int err = errno;    // 返回-1时errno是注册失败的原因，不能被下面改掉
+        fd_ctx->resetContext(event);
+        --m_pendingEventCount;
+        errno = err;
+        return -1;
+    }
+    return 0;    // 失败了但是已经被别人取消掉了，协程/回调会被调度，当成成功
 }
 
 bool IOManager::delEvent(int fd, Event event) 
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
-        return false;
-    }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!(fd_ctx->events & event)) {
+    FdContext *fd_ctx = getFdContext(fd);
+    if (!fd_ctx) {
         return false;
     }
 
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << ", " << fd << ", " << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+    uint32_t claimed = fd_ctx->claim(event);
+    if (!claimed) {
         return false;
     }
-
+    fd_ctx->resetContext(event);
     --m_pendingEventCount;
-    fd_ctx->events = new_events;
-    FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
-    fd_ctx->resetContext(event_ctx);
-    return false;
-
+    if (m_uring) {
+        uringPollRemove(fd_ctx, event, claimed);
+    } else if (!fd_ctx->latched()) {
+        syncEpoll(fd_ctx, false);
+    }
+    return true;
 }
 
 bool IOManager::cancleEvent(int fd, Event event)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext *fd_ctx = getFdContext(fd);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!(fd_ctx->events & event)) {
+    uint32_t claimed = fd_ctx->claim(event);
+    if (!claimed) {
         return false;
     }
-
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << ", " << fd << ", " << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if (m_uring) {
+        uringPollRemove(fd_ctx, event, claimed);
     }
-
     fd_ctx->triggerEvent(event);
     --m_pendingEventCount;
+    if (!m_uring && !fd_ctx->latched()) {
+        syncEpoll(fd_ctx, false);
+    }
     return true;
 }
+
 bool IOManager::cancleAllEvent(int fd)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext *fd_ctx = getFdContext(fd);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!(fd_ctx->events)) {
+    bool canceled = false;
+    for (Event event : {READ, WRITE}) {
+        uint32_t claimed = fd_ctx->claim(event);
+        if (!claimed) {
+            continue;
+        }
+        if (m_uring) {
+            uringPollRemove(fd_ctx, event, claimed);
+        }
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+        canceled = true;
+    }
+    if (m_uring) {
+        return canceled;
+    }
+    if (fd_ctx->mode == EDGE) {
+        if (canceled) {
+            syncEpoll(fd_ctx, false);
+        }
+    } else {
+        // fd马上要关了，这个号可能被复用，epoll里的注册和记下来的事件都不能留
+        epollUnregister(fd_ctx);
+        fd_ctx->read.state.fetch_and(~FdContext::PENDING);
+        fd_ctx->write.state.fetch_and(~FdContext::PENDING);
+    }
+    if (fd_ctx->zerocopy) {
+        resetZeroCopy(fd_ctx);
+    }
+    return canceled;
+}
+
+bool IOManager::setEventMode(int fd, EventMode mode)
+{
+    FdContext *fd_ctx = getFdContext(fd, true);
+    if (!fd_ctx || fd_ctx->armedEvents()) {
         return false;
     }
+    if (fd_ctx->mode == mode) {
+        return true;
+    }
+    if (!m_uring) {
+        epollUnregister(fd_ctx);
+    }
+    fd_ctx->read.state.fetch_and(~FdContext::PENDING);
+    fd_ctx->write.state.fetch_and(~FdContext::PENDING);
+    fd_ctx->mode = mode;
+    return true;
+}
 
-    int op = EPOLL_CTL_DEL;
+int IOManager::epollCtl(int epfd, int op, FdContext *fd_ctx, uint32_t events)
+{
+    ++m_epollCtls;
     epoll_event epevent;
-    epevent.events = 0;
+    epevent.events = events;
     epevent.data.ptr = fd_ctx;
+    return epoll_ctl(epfd, op, fd_ctx->fd, &epevent);
+}
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << ", " << fd << ", " << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+bool IOManager::epollRegister(FdContext *fd_ctx)
+{
+    if (fd_ctx->registered.exchange(true)) {
+        return true;
+    }
+    // EXCLUSIVE: 每个Reactor都加一份，只关注读(EPOLLEXCLUSIVE只能在ADD的时候设置，之后不能MOD)
+    bool exclusive = fd_ctx->mode == EXCLUSIVE;
+    uint32_t flags = exclusive ? (EPOLLET | EPOLLIN | EPOLLEXCLUSIVE) : (EPOLLET | EPOLLIN | EPOLLOUT);
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        if (!exclusive && (int)i != fd_ctx->owner) {
+            continue;
+        }
+        int epfd = m_reactors[i]->epfd;
+        int rt = epollCtl(epfd, EPOLL_CTL_ADD, fd_ctx, flags);
+        if (rt && errno != EEXIST) {
+            int err = errno;
+            SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << epfd << ", "
+                << EPOLL_CTL_ADD << ", " << fd_ctx->fd << ", " << flags << "):"
+                << rt << " (" << err << ") (" << strerror(err) << ")";
+            fd_ctx->registered = false;
+            for (size_t j = 0; j < i; ++j) {
+                epollCtl(m_reactors[j]->epfd, EPOLL_CTL_DEL, fd_ctx, 0);
+            }
+            errno = err;
+            return false;
+        }
     }
+    return true;
+}
 
-    if (fd_ctx->events & READ) {
-        fd_ctx->triggerEvent(READ);
-        --m_pendingEventCount;
+void IOManager::epollUnregister(FdContext *fd_ctx)
+{
+    if (!fd_ctx->registered.exchange(false)) {
+        return;
     }
-    if (fd_ctx->events & WRITE) {
-        fd_ctx->triggerEvent(WRITE);
-        --m_pendingEventCount;
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        if (fd_ctx->mode == EXCLUSIVE || (int)i == fd_ctx->owner) {
+            epollCtl(m_reactors[i]->epfd, EPOLL_CTL_DEL, fd_ctx, 0);
+        }
     }
+}
 
-    SYLAR_ASSERT(fd_ctx->events == 0);
-    return true;
+// 把epoll里关注的事件改成当前ARMED的事件(EDGE/ONESHOT模式)。不加锁，可能几个线程同时在改，所以改完再看一眼，
+// 状态又变了就按新状态再改一次；最后执行的那次epoll_ctl一定对应最终的状态
+bool IOManager::syncEpoll(FdContext *fd_ctx, bool try_add)
+{
+    int epfd = m_reactors[fd_ctx->owner]->epfd;
+    bool oneshot = fd_ctx->mode == ONESHOT;
+    while (true) {
+        int events = fd_ctx->armedEvents();
+        if (!events && oneshot) {
+            return true;    // 留在epoll里，最多再报一次没人要的事件，内核就把它停掉了，省掉一次DEL
+        }
+        int op = events ? (try_add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD) : EPOLL_CTL_DEL;
+        uint32_t flags = EPOLLET | events | (oneshot ? EPOLLONESHOT : 0);
+
+        int rt = epollCtl(epfd, op, fd_ctx, flags);
+        if (rt && errno == EEXIST) {
+            try_add = false;
+            continue;
+        }
+        if (rt && errno == ENOENT) {
+            if (events) {
+                try_add = true;
+                continue;
+            }
+            rt = 0;    // 本来就不在epoll里(比如fd被close过)
+        }
+        if (rt) {
+            int err = errno;
+            SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << epfd << ", "
+                << op << ", " << fd_ctx->fd << ", " << flags << "):"
+                << rt << " (" << err << ") (" << strerror(err) << ")";
+            errno = err;
+            return false;
+        }
+        if (fd_ctx->armedEvents() == events) {
+            return true;
+        }
+        try_add = !events;
+    }
 }
+
 IOManager *IOManager::GetThis()
 {
     return dynamic_cast<IOManager *>(Scheduler::GetThis());
@@ -257,52 +677,219 @@ IOManager *IOManager::GetThis()
 void IOManager::tickle() 
 {
     // 每当执行它的时候，发一个消息
-    if (!hasIdleThreads()) {
+    if (m_loopStats) {
+        ++m_tickles;
+    }
+    bool self = t_timer_iom == this;
+    if (m_idleThreadCount <= (self ? 1u : 0u)) {    // 只有自己在idle的话，回去就会取到任务
+        return;
+    }
+    if (m_uring) {    // 提交一个NOP，它的完成事件就能把等在io_uring_enter里的线程唤醒
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof sqe);
+        sqe.opcode = IORING_OP_NOP;
+        m_uring->push(sqe);
+        m_uring->submit();
+        if (m_loopStats) {
+            ++m_tickleWrites;
+        }
         return;
     }
-    int rt = write(m_tickleFds[1], "1", 1);
-    SYLAR_ASSERT(rt == 1);
+    if (m_reactors.size() == 1) {
+        tickleReactor(m_reactors[0]);
+        return;
+    }
+    // 每个线程一个epoll的时候，只能唤醒一个正在idle的线程；要停止的时候把所有idle的都唤醒
+    size_t start = m_tickleIndex++;
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        size_t idx = (start + i) % m_reactors.size();
+        Reactor *r = m_reactors[idx];
+        if (r->idle && !(self && (int)idx == getReactorIndex())) {
+            tickleReactor(r);
+            if (!m_stopping) {
+                return;
+            }
+        }
+    }
+}
+
+// 每个睡着的线程最多只有一次还没处理的唤醒，连续的tickle合并掉，不再每次都write
+void IOManager::tickleReactor(Reactor *r)
+{
+    size_t pending = r->tickled;
+    do {
+        if (pending >= std::max<size_t>(r->idle, 1)) {
+            return;
+        }
+    } while (!r->tickled.compare_exchange_weak(pending, pending + 1));
+    if (m_loopStats) {
+        ++m_tickleWrites;
+    }
+    int rt = eventfd_write(r->tickleFd, 1);
+    SYLAR_ASSERT(!rt);
+}
+
+int IOManager::getReactorIndex()
+{
+    if (m_reactors.size() == 1) {
+        return 0;
+    }
+    if (Scheduler::GetThis() != this) {
+        return -1;
+    }
+    if (t_reactor_iom != this) {    // 线程第一次用到，按顺序分一个下标，线程数和Reactor数一样，每个线程独占一个
+        t_reactor_iom = this;
+        if (m_rootThreadId == -1) {
+            t_reactor_index = m_reactorCount++ % m_reactors.size();
+        } else if (sylar::GetThreadId() == m_rootThreadId) {    // use_caller的线程固定用0号
+            t_reactor_index = 0;
+        } else {
+            t_reactor_index = 1 + m_reactorCount++ % (m_reactors.size() - 1);
+        }
+    }
+    return t_reactor_index;
+}
+
+int IOManager::pickOwner(int fd)
+{
+    int idx = getReactorIndex();
+    if (idx == -1) {
+        idx = fd % m_reactors.size();
+    }
+    return idx;
 }
 
 bool IOManager::stopping(uint64_t &timeout)
 {
-    timeout = getNextTimer();
-    return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+    timeout = getNextTimerUs();    // 只看自己的定时器队列，但别的线程还有定时器的话也不能退出
+    return !hasTimer() && m_pendingEventCount == 0 && Scheduler::stopping();
 }
 
 // 如果定时器没结束，也不能算结束了
 bool IOManager::stopping() 
 {
     // return Scheduler::stopping() && m_pendingEventCount == 0;
-    // return m_pendingEventCount == 0 && !hasTimer() && Scheduler::stopping();
-    uint64_t timeout = 0;
-    return stopping(timeout);
+    return m_pendingEventCount == 0 && !hasTimer() && Scheduler::stopping();
 }
 
 // 核心
 void IOManager::idle()
 {
-    epoll_event *events = new epoll_event[64]();   // new 64个event
-    std::shared_ptr<epoll_event> shared_events(events, [](epoll_event *ptr) {
-        delete[] ptr;
-    });
+    if (m_uring) {
+        idleUring();
+    } else {
+        idleEpoll();
+    }
+}
+
+IOManager::PollStats IOManager::getPollStats()
+{
+    PollStats stats;
+    stats.loops = m_pollLoops;
+    stats.emptyPolls = m_pollEmpty;
+    stats.events = m_pollEvents;
+    stats.ctls = m_epollCtls;
+    for (size_t i = 0; i < sizeof(stats.batch) / sizeof(stats.batch[0]); ++i) {
+        stats.batch[i] = m_pollBatch[i];
+    }
+    return stats;
+}
+
+// 微秒精度的epoll_wait：内核支持就用epoll_pwait2(5.11+)，不支持的话退回到epoll_wait，超时向上取整到毫秒
+static int epoll_wait_us(int epfd, epoll_event *events, int maxevents, uint64_t timeout_us)
+{
+    static std::atomic<bool> s_has_pwait2 = {true};
+    if (s_has_pwait2.load(std::memory_order_relaxed)) {
+        struct timespec ts;
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = timeout_us % 1000000 * 1000;
+        int rt = epoll_pwait2(epfd, events, maxevents, &ts, nullptr);
+        if (rt >= 0 || errno != ENOSYS) {
+            return rt;
+        }
+        s_has_pwait2 = false;
+        SYLAR_LOG_INFO(g_logger) << "epoll_pwait2 not supported, timers fall back to millisecond precision";
+    }
+    return epoll_wait_f(epfd, events, maxevents, (int)((timeout_us + 999) / 1000));    // 线程开了hook，要用原始的
+}
+
+IOManager::LoopCounters *IOManager::newLoopCounters()
+{
+    if (!m_loopStats) {
+        return nullptr;
+    }
+    LoopCounters *counters = new LoopCounters;
+    counters->threadId = sylar::GetThreadId();
+    Mutex::Lock lock(m_loopMutex);
+    m_loopCounters.push_back(counters);
+    return counters;
+}
+
+IOManager::LoopSnapshot IOManager::getLoopStats()
+{
+    LoopSnapshot snapshot;
+    {
+        Mutex::Lock lock(m_loopMutex);
+        snapshot.threads.resize(m_loopCounters.size());
+        for (size_t i = 0; i < m_loopCounters.size(); ++i) {
+            LoopCounters *c = m_loopCounters[i];
+            LoopStats &stats = snapshot.threads[i];
+            stats.threadId = c->threadId;
+            stats.loops = c->loops.load(std::memory_order_relaxed);
+            stats.tickleWakeups = c->tickleWakeups.load(std::memory_order_relaxed);
+            c->waitUs.read(stats.waitUs);
+            c->events.read(stats.events);
+            c->timerLagUs.read(stats.timerLagUs);
+            c->runUs.read(stats.runUs);
+        }
+    }
+    snapshot.pendingEvents = m_pendingEventCount;
+    snapshot.tickles = m_tickles;
+    snapshot.tickleWrites = m_tickleWrites;
+    return snapshot;
+}
+
+void IOManager::idleEpoll()
+{
+    // 一次最多取多少个事件随负载调整：取满了就翻倍，连续很多次都很空就减半
+    static const size_t MIN_EVENTS = 64;
+    static const size_t MAX_EVENTS = 1024;
+    std::vector<epoll_event> events(MIN_EVENTS);
+    int sparse = 0;
+    Reactor *reactor = m_reactors[getReactorIndex()];
+    int epfd = reactor->epfd;
+    static thread_local IOManager *s_busy_iom = nullptr;
+    if (s_busy_iom != this && m_busyPollAssigned < m_busyPollThreads
+            && m_busyPollAssigned++ < m_busyPollThreads) {
+        s_busy_iom = this;
+        SYLAR_LOG_INFO(g_logger) << "name=" << getName() << " busy poll thread=" << sylar::GetThreadId();
+    }
+    bool busy_poll = s_busy_iom == this;
+    LoopCounters *stats = newLoopCounters();
+    std::vector<uint64_t> lateness;
  
     while (true) {
+        ++reactor->idle;
         uint64_t next_timeout = 0;
         if (stopping(next_timeout)) {
             SYLAR_LOG_INFO(g_logger) << "name=" << getName() << " idle stopping exit";
+            --reactor->idle;
+            tickle();    // 最后一个事件处理完的时候别的线程可能还睡在epoll_wait里，叫醒它们也退出
+            ClearNow();
             break;    
         }
 
         int rt = 0;
+        uint64_t wait_start = stats ? sylar::GetCurrentUS() : 0;
         do {
-            static const int MAX_TIMEOUT = 3000;   // 3s      // 有了定时器就可以设置epoll_wait时间了  默认的最大超时时间为3s
-            if (next_timeout != ~0ull) {
-                next_timeout = (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
-            } else {
+            static const uint64_t MAX_TIMEOUT = 3000 * 1000;   // 3s      // 有了定时器就可以设置epoll_wait时间了  默认的最大超时时间为3s
+            if (next_timeout > MAX_TIMEOUT) {
                 next_timeout = MAX_TIMEOUT;
             }
-            rt = epoll_wait(m_epfd, events, 64, (int)next_timeout);
+            if (busy_poll) {
+                next_timeout = 0;
+            }
+            rt = epoll_wait_us(epfd, &events[0], events.size(), next_timeout);
 
             if (rt < 0 && errno == EINTR) {
                 ;
@@ -311,11 +898,45 @@ void IOManager::idle()
             }
         } while (true);
 
+        if (stats) {
+            bump(stats->loops, 1);
+            stats->waitUs.add(sylar::GetCurrentUS() - wait_start);
+            stats->events.add(rt > 0 ? rt : 0);
+        }
+        ++m_pollLoops;
+        if (rt <= 0) {
+            ++m_pollEmpty;
+        } else {
+            m_pollEvents += rt;
+            int bucket = 0;
+            while (bucket < 7 && (rt >> (bucket + 1))) {
+                ++bucket;
+            }
+            ++m_pollBatch[bucket];
+            if ((size_t)rt == events.size() && events.size() < MAX_EVENTS) {
+                events.resize(events.size() * 2);
+                sparse = 0;
+            } else if ((size_t)rt <= events.size() / 8 && events.size() > MIN_EVENTS && ++sparse >= 64) {
+                events.resize(events.size() / 2);
+                sparse = 0;
+            }
+        }
+
         std::vector<std::function<void()>> cbs;
-        listExpiredCb(cbs);    // 返回当前时间点满足条件的回调
+        listExpiredCb(cbs, stats ? &lateness : nullptr);    // 返回当前时间点满足条件的回调
+        for (auto l : lateness) {
+            stats->timerLagUs.add(l);
+        }
+        lateness.clear();
+        if (busy_poll && rt <= 0 && cbs.empty()) {
+            --reactor->idle;
+            continue;    // 空转的线程没事件就接着poll，不回run里去抢锁；有新任务时tickle会让它poll到eventfd
+        }
         if (!cbs.empty()) {
             // 这样是失败的
+            t_timer_iom = this;    // 同一时刻到期的回调一次调度，要唤醒也只唤醒别的线程
             schedule(cbs.begin(), cbs.end());
+            t_timer_iom = nullptr;
             // 这样一个一个是成功的，说明那个schedule迭代器是有问题的（检查发现是迭代器版本的schedule里begin没有自增，导致死循环了）
             // for (auto &it : cbs)
             //     schedule(it);
@@ -324,16 +945,33 @@ void IOManager::idle()
 
         for (int i = 0; i < rt; ++i) {
             epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {   // 事件类型是EPOLLET的，如果不读干净，就不会再重置了
-                uint8_t dummy;
-                while (read(m_tickleFds[0], &dummy, 1) == 1);
+            if (m_signalFd >= 0 && (event.data.fd == m_signalFd || event.data.fd == m_signalWakeFd)) {
+                handleSignals();
+                continue;
+            }
+            if (event.data.fd == reactor->tickleFd) {   // 事件类型是EPOLLET的，eventfd读一次就把计数清零了
+                eventfd_t cnt = 0;
+                if (eventfd_read(reactor->tickleFd, &cnt) == 0 && cnt > 0) {
+                    // 自己只用掉一次唤醒，一次读出来的其他唤醒写回去，留给其他睡着的线程(停止的时候要靠这个把所有线程叫醒)
+                    --reactor->tickled;
+                    if (stats) {
+                        bump(stats->tickleWakeups, 1);
+                    }
+                    if (cnt > 1) {
+                        eventfd_write(reactor->tickleFd, cnt - 1);
+                    }
+                }
                 continue;
             }
 
             FdContext *fd_ctx = (FdContext *)event.data.ptr;
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            int mode = fd_ctx->mode;
+            if ((event.events & EPOLLERR) && fd_ctx->zerocopy && reapZeroCopy(fd_ctx)) {
+                event.events &= ~EPOLLERR;    // 是zerocopy的完成通知，不是socket出错，不用叫醒读写
+            }
             if (event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= EPOLLIN | EPOLLOUT;
+                // 只触发注册过的事件；PERSIST/EXCLUSIVE模式下出错以后不会再报了，读写都要记下来
+                event.events |= (EPOLLIN | EPOLLOUT) & (fd_ctx->latched() ? ~0 : fd_ctx->armedEvents());
             }
             int real_events = NONE;
             if (event.events & EPOLLIN) {
@@ -343,46 +981,702 @@ void IOManager::idle()
                 real_events |= WRITE;
             }
 
-            if ((fd_ctx->events & real_events) == NONE) {   // 没事件
-                continue;
+            // 有事件，抢到的才触发，同时在取消/删除的线程抢到了就不管了
+            bool triggered = false;
+            for (Event e : {READ, WRITE}) {
+                if ((real_events & e) && fd_ctx->fire(e)) {
+                    --m_pendingEventCount;
+                    triggered = true;
+                }
             }
+            if (mode == ONESHOT) {
+                // 报过一次内核就把整个fd停掉了，另一个事件还在等的话要重新打开
+                if (fd_ctx->armedEvents()) {
+                    syncEpoll(fd_ctx, false);
+                }
+            } else if (mode == EDGE && triggered) {
+                syncEpoll(fd_ctx, false);    // 把触发过的事件从epoll里去掉
+            }
+        }
 
-            // 有事件
-            int left_events = (fd_ctx->events & ~real_events);        // 剩余的事件
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
+        --reactor->idle;
+        Fiber::ptr cur = Fiber::GetThis();
+        auto raw_ptr = cur.get();
+        cur.reset();
 
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if (rt2) {
-                SYLAR_LOG_INFO(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << op << ", " << fd_ctx->fd << ", " << event.events << "):"
-                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
-            }
+        uint64_t run_start = stats ? sylar::GetCurrentUS() : 0;
+        raw_ptr->swapOut();
+        if (stats) {
+            stats->runUs.add(sylar::GetCurrentUS() - run_start);
+        }
+    }
+}
 
-            if (real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
-            }
-            if (real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                --m_pendingEventCount;
-            }
+void IOManager::idleUring()
+{
+    std::vector<io_uring_cqe> cqes;
+    LoopCounters *stats = newLoopCounters();
+    std::vector<uint64_t> lateness;
+    while (true) {
+        uint64_t next_timeout = 0;
+        if (stopping(next_timeout)) {
+            SYLAR_LOG_INFO(g_logger) << "name=" << getName() << " idle stopping exit";
+            tickle();
+            ClearNow();
+            break;
+        }
+
+        static const uint64_t MAX_TIMEOUT = 3000 * 1000;
+        if (next_timeout > MAX_TIMEOUT) {
+            next_timeout = MAX_TIMEOUT;
+        }
+        // 这一轮攒下的sqe在这里一次提交，顺便等完成事件
+        uint64_t wait_start = stats ? sylar::GetCurrentUS() : 0;
+        int rt = m_uring->wait(next_timeout);
+        if (stats) {
+            bump(stats->loops, 1);
+            stats->waitUs.add(sylar::GetCurrentUS() - wait_start);
+        }
+        if (rt < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_enter(" << m_uring->getFd() << "):"
+                << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        }
+
+        std::vector<std::function<void()>> cbs;
+        listExpiredCb(cbs, stats ? &lateness : nullptr);
+        for (auto l : lateness) {
+            stats->timerLagUs.add(l);
+        }
+        lateness.clear();
+        if (!cbs.empty()) {
+            t_timer_iom = this;
+            schedule(cbs.begin(), cbs.end());
+            t_timer_iom = nullptr;
+            cbs.clear();
+        }
+
+        cqes.clear();
+        m_uring->reap(cqes);
+        if (stats) {
+            stats->events.add(cqes.size());
+        }
+        for (auto &cqe : cqes) {
+            uringComplete(cqe);
         }
 
         Fiber::ptr cur = Fiber::GetThis();
         auto raw_ptr = cur.get();
         cur.reset();
 
+        uint64_t run_start = stats ? sylar::GetCurrentUS() : 0;
         raw_ptr->swapOut();
+        if (stats) {
+            stats->runUs.add(sylar::GetCurrentUS() - run_start);
+        }
+    }
+}
+
+// 调用时事件已经是ARMED了，完成事件到得再早也能触发
+bool IOManager::uringPollAdd(FdContext *fd_ctx, Event event, uint32_t state)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = fd_ctx->fd;
+    sqe.poll32_events = event;    // READ/WRITE和POLLIN/POLLOUT的值一样
+    sqe.user_data = uring_poll_data(fd_ctx->fd, event, state);
+    if (!m_uring->push(sqe)) {
+        errno = ENOBUFS;    // 提交队列满了
+        return false;
+    }
+    uringFlush();
+    return true;
+}
+
+bool IOManager::uringPollRemove(FdContext *fd_ctx, Event event, uint32_t state)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_POLL_REMOVE;
+    sqe.fd = -1;
+    sqe.addr = uring_poll_data(fd_ctx->fd, event, state);
+    if (!m_uring->push(sqe)) {
+        return false;
+    }
+    uringFlush();
+    return true;
+}
+
+// 有线程睡在io_uring_enter里的话要马上提交，不然它醒来之前sqe都不会被内核看到
+// 没有空闲线程的话就先攒着，等某个线程进idle的时候一次性提交
+void IOManager::uringFlush()
+{
+    if (hasIdleThreads()) {
+        m_uring->submit();
+    }
+}
+
+void IOManager::uringComplete(const io_uring_cqe &cqe)
+{
+    uint64_t data = cqe.user_data;
+    switch (data & URING_TAG_MASK) {
+        case READ:
+        case WRITE: {
+            Event event = (Event)(data & URING_TAG_MASK);
+            int fd = (data >> 3) & 0x1fffffff;
+            uint32_t state = data >> 32;
+            FdContext *fd_ctx = getFdContext(fd);
+            if (!fd_ctx) {
+                return;
+            }
+            // 已经被删掉或者又重新注册过了，这是旧注册迟到的完成事件，抢不到
+            uint32_t claimed = fd_ctx->claim(event, state);
+            if (!claimed) {
+                return;
+            }
+            fd_ctx->triggerEvent(event);
+            --m_pendingEventCount;
+            return;
+        }
+        case URING_OP: {
+            UringCompletion *comp = (UringCompletion *)(data & ~URING_TAG_MASK);
+            // 调度之后协程随时可能跑完，comp就在它的栈上，所以先把要用的东西拿出来
+            Scheduler *scheduler = comp->scheduler;
+            Fiber::ptr fiber;
+            fiber.swap(comp->fiber);
+            comp->res = cqe.res;
+            --m_pendingEventCount;
+            scheduler->schedule(&fiber);
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+int IOManager::uringSubmitAndWait(io_uring_sqe &sqe)
+{
+    UringCompletion comp;
+    comp.scheduler = Scheduler::GetThis();
+    comp.fiber = Fiber::GetThis();
+    comp.res = 0;
+    sqe.user_data = (uint64_t)&comp | URING_OP;
+    ++m_pendingEventCount;
+    if (!m_uring->push(sqe)) {
+        --m_pendingEventCount;
+        return -EBUSY;
+    }
+    uringFlush();
+    Fiber::YieldToHold();
+    return comp.res;
+}
+
+// epoll后端：非阻塞调用，EAGAIN的话注册事件，等fd就绪后重试；用原始的系统调用，不要再走一遍hook
+template<typename Fun>
+static ssize_t epoll_retry(IOManager *iom, int fd, IOManager::Event event, Fun fun)
+{
+    while (true) {
+        ssize_t n = fun();
+        if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (iom->addEvent(fd, event)) {
+            return -1;
+        }
+        Fiber::YieldToHold();
+    }
+}
+
+ssize_t IOManager::asyncRead(int fd, void *buf, size_t count)
+{
+    if (!m_uring) {
+        return epoll_retry(this, fd, READ, [fd, buf, count]() {
+            return read_f(fd, buf, count);
+        });
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)buf;
+    sqe.len = count;
+    sqe.off = (uint64_t)-1;
+    int rt = uringSubmitAndWait(sqe);
+    if (rt < 0) {
+        errno = -rt;
+        return -1;
+    }
+    return rt;
+}
+
+ssize_t IOManager::asyncWrite(int fd, const void *buf, size_t count)
+{
+    if (!m_uring) {
+        return epoll_retry(this, fd, WRITE, [fd, buf, count]() {
+            return write_f(fd, buf, count);
+        });
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)buf;
+    sqe.len = count;
+    sqe.off = (uint64_t)-1;
+    int rt = uringSubmitAndWait(sqe);
+    if (rt < 0) {
+        errno = -rt;
+        return -1;
+    }
+    return rt;
+}
+
+int IOManager::asyncAccept(int fd, sockaddr *addr, socklen_t *addrlen)
+{
+    if (!m_uring) {
+        return epoll_retry(this, fd, READ, [fd, addr, addrlen]() {
+            return accept_f(fd, addr, addrlen);
+        });
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)addr;
+    sqe.addr2 = (uint64_t)addrlen;
+    int rt = uringSubmitAndWait(sqe);
+    if (rt < 0) {
+        errno = -rt;
+        return -1;
+    }
+    return rt;
+}
+
+int IOManager::asyncConnect(int fd, const sockaddr *addr, socklen_t addrlen)
+{
+    if (!m_uring) {
+        int rt = connect_f(fd, addr, addrlen);
+        if (rt == 0 || errno != EINPROGRESS) {
+            return rt;
+        }
+        if (addEvent(fd, WRITE)) {
+            return -1;
+        }
+        Fiber::YieldToHold();
+        int error = 0;
+        socklen_t len = sizeof(int);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+            return -1;
+        }
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_CONNECT;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)addr;
+    sqe.off = addrlen;
+    int rt = uringSubmitAndWait(sqe);
+    if (rt < 0) {
+        errno = -rt;
+        return -1;
+    }
+    return 0;
+}
+
+bool IOManager::enableZeroCopy(int fd)
+{
+    if (m_uring) {
+        return false;
+    }
+    FdContext *fd_ctx = getFdContext(fd, true);
+    if (!fd_ctx) {
+        return false;
+    }
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on)) {
+        SYLAR_LOG_INFO(g_logger) << "setsockopt(" << fd << ", SO_ZEROCOPY) errno=" << errno
+            << " (" << strerror(errno) << ")";
+        return false;
+    }
+    // 完成通知是EPOLLERR，fd没有事件在等的时候也要在epoll里
+    if (!setEventMode(fd, PERSIST)) {
+        return false;
+    }
+    int owner = -1;
+    fd_ctx->owner.compare_exchange_strong(owner, pickOwner(fd));
+    if (!epollRegister(fd_ctx)) {
+        return false;
+    }
+    ZeroCopy *zc = fd_ctx->zerocopy;
+    if (!zc) {
+        ZeroCopy *new_zc = new ZeroCopy;
+        if (fd_ctx->zerocopy.compare_exchange_strong(zc, new_zc)) {
+            zc = new_zc;
+        } else {
+            delete new_zc;
+        }
+    }
+    Mutex::Lock lock(zc->mutex);
+    zc->enabled = true;
+    zc->nextId = 0;
+    return true;
+}
+
+ssize_t IOManager::sendZeroCopy(int fd, const void *buf, size_t len, std::function<void()> release)
+{
+    FdContext *fd_ctx = getFdContext(fd);
+    ZeroCopy *zc = fd_ctx ? fd_ctx->zerocopy.load() : nullptr;
+    bool copy = !zc || len < m_zeroCopyMinSize;
+    if (copy) {
+        ++m_zcFallbacks;
+    }
+    std::shared_ptr<ZeroCopyReq> req(new ZeroCopyReq);
+    req->release = release;
+
+    const char *p = (const char *)buf;
+    size_t left = len;
+    int err = 0;
+    while (left > 0) {
+        ssize_t n = -1;
+        if (copy) {
+            n = send_f(fd, p, left, MSG_NOSIGNAL);
+        } else {
+            // 编号按内核处理send的顺序来，同一个fd上的zerocopy发送要串起来
+            Mutex::Lock lock(zc->mutex);
+            if (!zc->enabled) {
+                copy = true;
+                continue;
+            }
+            n = send_f(fd, p, left, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n >= 0) {
+                ++req->outstanding;
+                zc->inflight[zc->nextId++] = req;
+                ++m_zcSends;
+            }
+        }
+        if (n >= 0) {
+            p += n;
+            left -= n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == ENOBUFS && !copy) {    // 没完成的通知超过了optmem_max，剩下的拷贝着发
+            copy = true;
+            ++m_zcFallbacks;
+            continue;
+        }
+        if (errno == EAGAIN) {
+            if (addEvent(fd, WRITE)) {
+                err = errno;    // 和do_io一样，保留addEvent失败的原因
+                break;
+            }
+            Fiber::YieldToHold();
+            continue;
+        }
+        err = errno;
+        break;
+    }
+
+    bool done = true;
+    if (zc) {
+        Mutex::Lock lock(zc->mutex);
+        req->sealed = true;
+        done = req->outstanding == 0;
+    }
+    if (done && req->release) {
+        req->release();
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return len;
+}
+
+void IOManager::flushZeroCopy(int fd)
+{
+    FdContext *fd_ctx = getFdContext(fd);
+    ZeroCopy *zc = fd_ctx ? fd_ctx->zerocopy.load() : nullptr;
+    if (!zc) {
+        return;
+    }
+    {
+        Mutex::Lock lock(zc->mutex);
+        if (zc->inflight.empty()) {
+            return;
+        }
+        zc->flushWaiters.push_back(std::make_pair(Scheduler::GetThis(), Fiber::GetThis()));
+        ++m_pendingEventCount;    // 等通知的时候IOManager不能停
+    }
+    Fiber::YieldToHold();
+}
+
+bool IOManager::reapZeroCopy(FdContext *fd_ctx)
+{
+    bool reaped = false;
+    while (true) {
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg_f(fd_ctx->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err *serr = (sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            reaped = true;
+            completeZeroCopy(fd_ctx->zerocopy, serr->ee_info, serr->ee_data
+                    , serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+    return reaped;
+}
+
+// 一个通知覆盖[lo, hi]这一段编号(编号是32位的，会回绕)
+void IOManager::completeZeroCopy(ZeroCopy *zc, uint32_t lo, uint32_t hi, bool copied)
+{
+    uint64_t count = (uint32_t)(hi - lo) + 1ull;
+    m_zcCompletions += count;
+    if (copied) {
+        m_zcCopied += count;
+    }
+
+    std::vector<std::function<void()>> releases;
+    std::vector<std::pair<Scheduler *, Fiber::ptr>> waiters;
+    {
+        Mutex::Lock lock(zc->mutex);
+        auto finish = [&](std::map<uint32_t, std::shared_ptr<ZeroCopyReq>>::iterator begin
+                , std::map<uint32_t, std::shared_ptr<ZeroCopyReq>>::iterator end) {
+            for (auto it = begin; it != end;) {
+                ZeroCopyReq *req = it->second.get();
+                if (--req->outstanding == 0 && req->sealed && req->release) {
+                    releases.push_back(req->release);
+                }
+                zc->inflight.erase(it++);
+            }
+        };
+        if (lo <= hi) {
+            finish(zc->inflight.lower_bound(lo), zc->inflight.upper_bound(hi));
+        } else {
+            finish(zc->inflight.lower_bound(lo), zc->inflight.end());
+            finish(zc->inflight.begin(), zc->inflight.upper_bound(hi));
+        }
+        if (zc->inflight.empty()) {
+            waiters.swap(zc->flushWaiters);
+        }
+    }
+    if (!releases.empty()) {
+        schedule(releases.begin(), releases.end());
+    }
+    for (auto &w : waiters) {
+        w.first->schedule(w.second);
+        --m_pendingEventCount;
     }
 }
 
+void IOManager::resetZeroCopy(FdContext *fd_ctx)
+{
+    ZeroCopy *zc = fd_ctx->zerocopy;
+    reapZeroCopy(fd_ctx);
+    std::vector<std::function<void()>> releases;
+    std::vector<std::pair<Scheduler *, Fiber::ptr>> waiters;
+    {
+        Mutex::Lock lock(zc->mutex);
+        if (!zc->inflight.empty()) {
+            SYLAR_LOG_WARN(g_logger) << "fd=" << fd_ctx->fd << " closed with " << zc->inflight.size()
+                << " zerocopy sends not completed";
+        }
+        for (auto &i : zc->inflight) {
+            if (--i.second->outstanding == 0 && i.second->sealed && i.second->release) {
+                releases.push_back(i.second->release);
+            }
+        }
+        zc->inflight.clear();
+        waiters.swap(zc->flushWaiters);
+        zc->enabled = false;
+        zc->nextId = 0;
+    }
+    if (!releases.empty()) {
+        schedule(releases.begin(), releases.end());
+    }
+    for (auto &w : waiters) {
+        w.first->schedule(w.second);
+        --m_pendingEventCount;
+    }
+}
+
+IOManager::ZeroCopyStats IOManager::getZeroCopyStats()
+{
+    ZeroCopyStats stats;
+    stats.sends = m_zcSends;
+    stats.completions = m_zcCompletions;
+    stats.copied = m_zcCopied;
+    stats.fallbacks = m_zcFallbacks;
+    return stats;
+}
+
 // 一般的话，如果有一个新的定时器加到了它的前面，我们需要唤醒epoll_wait让他重新设置一下定时的时间
-void IOManager::onTimerInsertAtFront()
+void IOManager::onTimerInsertAtFront(size_t queue)
 {
     // 往里面写一个事件，如果有另一个先epoll_wait,他就可以先唤醒，重新计算时间，就可以算到一个新的时间上去
-    tickle();
+    if (m_uring || m_reactors.size() == 1) {
+        tickle();
+    } else {
+        tickleReactor(m_reactors[queue]);    // 每个线程一个队列时只有处理这个队列的线程要重新算时间
+    }
+}
+
+// 每个线程只处理自己的队列，use_caller的线程是0号，它的队列一直是空的；stop里它只等别的队列被各自的线程取完
+size_t IOManager::getTimerQueue()
+{
+    if (m_uring || m_reactors.size() == 1) {
+        return 0;
+    }
+    int idx = getReactorIndex();
+    return idx == -1 ? 0 : idx;
+}
+
+size_t IOManager::pickTimerQueue()
+{
+    if (m_uring || m_reactors.size() == 1) {
+        return 0;
+    }
+    // use_caller的线程要到stop的时候才进事件循环，它加的定时器和外面线程加的一样，轮流放到工作线程的队列里
+    int idx = getReactorIndex();
+    if (idx == -1 || sylar::GetThreadId() == m_rootThreadId) {
+        size_t first = m_rootThreadId != -1 ? 1 : 0;
+        return first + m_timerQueueIndex++ % (m_reactors.size() - first);
+    }
+    return idx;
+}
+
+bool IOManager::addSignal(int signo, std::function<void()> cb)
+{
+    if (signo <= 0 || signo > MAX_SIGNAL || signo == SIGKILL || signo == SIGSTOP || !cb) {
+        errno = EINVAL;
+        return false;
+    }
+    if (m_uring) {
+        SYLAR_LOG_ERROR(g_logger) << "name=" << getName() << " addSignal(" << signo << ") not supported with io_uring";
+        errno = ENOTSUP;
+        return false;
+    }
+    // use_caller的线程是0号Reactor，它要到stop()才进事件循环，信号fd挂在工作线程的Reactor上
+    Reactor *reactor = m_reactors[m_rootThreadId != -1 && m_reactors.size() > 1 ? 1 : 0];
+    Mutex::Lock lock(m_signalMutex);
+    if (m_signalFd < 0) {
+        sigset_t empty;
+        sigemptyset(&empty);
+        m_signalFd = signalfd(-1, &empty, SFD_NONBLOCK | SFD_CLOEXEC);
+        m_signalWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(m_signalFd >= 0 && m_signalWakeFd >= 0);
+        epoll_event event;
+        memset(&event, 0, sizeof event);
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = m_signalWakeFd;
+        int rt = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, m_signalWakeFd, &event);
+        SYLAR_ASSERT(!rt);
+        event.data.fd = m_signalFd;
+        rt = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, m_signalFd, &event);
+        SYLAR_ASSERT(!rt);
+    }
+    bool exists = m_signals.count(signo);
+    m_signals[signo] = cb;
+    if (exists) {
+        return true;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    s_signal_wake_fds[signo] = m_signalWakeFd;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = forward_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, &s_old_actions[signo]);
+
+    for (auto &i : m_signals) {
+        sigaddset(&set, i.first);
+    }
+    signalfd(m_signalFd, &set, 0);
+    // 改了屏蔽集合以后重新挂一下，已经在等的信号也能报出来
+    epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = m_signalFd;
+    epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, m_signalFd, &event);
+    return true;
+}
+
+bool IOManager::delSignal(int signo)
+{
+    Mutex::Lock lock(m_signalMutex);
+    if (!m_signals.erase(signo)) {
+        return false;
+    }
+    sigaction(signo, &s_old_actions[signo], nullptr);
+    s_signal_wake_fds[signo] = -1;
+    s_caught_signals.fetch_and(~(1ull << (signo - 1)));
+
+    sigset_t set;
+    sigemptyset(&set);
+    for (auto &i : m_signals) {
+        sigaddset(&set, i.first);
+    }
+    signalfd(m_signalFd, &set, 0);
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    return true;
 }
 
-}
\ No newline at end of file
+void IOManager::handleSignals()
+{
+    uint64_t arrived = 0;
+    signalfd_siginfo info;
+    while (read_f(m_signalFd, &info, sizeof info) == sizeof info) {
+        if (info.ssi_signo >= 1 && info.ssi_signo <= (uint32_t)MAX_SIGNAL) {
+            arrived |= 1ull << (info.ssi_signo - 1);
+        }
+    }
+    eventfd_t cnt = 0;
+    eventfd_read(m_signalWakeFd, &cnt);
+
+    std::vector<std::function<void()>> cbs;
+    {
+        Mutex::Lock lock(m_signalMutex);
+        for (auto &i : m_signals) {
+            uint64_t bit = 1ull << (i.first - 1);
+            if ((arrived & bit) || (s_caught_signals.fetch_and(~bit) & bit)) {
+                cbs.push_back(i.second);
+            }
+        }
+    }
+    if (!cbs.empty()) {
+        schedule(cbs.begin(), cbs.end());
+    }
+}
+
+}
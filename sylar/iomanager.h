@@ -2,10 +2,13 @@
 #define __SYLAR_IOMANAGER_H__
 
 #include <memory>
+#include <map>
+#include <sys/socket.h>
 #include "scheduler.h"
 #include "thread.h"
 #include "fiber.h"
 #include "timer.h"
+#include "uring.h"
 
 namespace sylar {
 
@@ -19,50 +22,230 @@ public:
         READ = 0x1,    // EPOLLIN
         WRITE = 0x4    // EPOLLOUT
     };
+
+    // fd在epoll里的注册方式(io_uring后端忽略)
+    enum EventMode {
+        EDGE = 0,      // 默认，只关注注册了的事件，触发后epoll_ctl去掉
+        ONESHOT = 1,   // EPOLLONESHOT，触发后内核自己去掉，重新注册只要一次epoll_ctl
+        PERSIST = 2,   // 第一次注册时把读写都加进去，之后不再epoll_ctl，没人等的事件记下来，注册时直接触发
+        EXCLUSIVE = 3  // 多个线程共用的监听socket: 和PERSIST一样，只是带EPOLLEXCLUSIVE加到每个Reactor里，来一个连接只叫醒一个线程，只能等READ
+    };
 private:
+    // MSG_ZEROCOPY发送的一次sendZeroCopy调用，它的每次send_f占一个内核编号，编号都完成了才能释放用户的buffer
+    struct ZeroCopyReq {
+        size_t outstanding = 0;    // 还没收到完成通知的编号数
+        bool sealed = false;       // 这次调用的数据都交给内核了，之后不会再加编号
+        std::function<void()> release;
+    };
+    // 开了SO_ZEROCOPY的fd的状态，分配了就跟着FdContext一直存在，fd关掉的时候重置
+    struct ZeroCopy {
+        Mutex mutex;
+        bool enabled = false;
+        uint32_t nextId = 0;       // 内核给这个socket上每次成功的MSG_ZEROCOPY发送按顺序编的号
+        std::map<uint32_t, std::shared_ptr<ZeroCopyReq>> inflight;
+        std::vector<std::pair<Scheduler *, Fiber::ptr>> flushWaiters;
+    };
+
     struct FdContext {
-        typedef Mutex MutexType;
+        // 每个事件一个状态机，不用锁，全部用CAS推进:
+        // IDLE -> ARMING(注册的线程在填上下文) -> ARMED(等事件) -> FIRING(触发/取消/删除的线程抢到了) -> IDLE
+        // 状态字的低2位是状态，第3位是PENDING，高位是代数，每次注册加一，迟到的旧完成事件CAS不会成功
+        enum State {
+            IDLE = 0,
+            ARMING = 1,
+            ARMED = 2,
+            FIRING = 3
+        };
+        static const uint32_t STATE_MASK = 0x3;
+        static const uint32_t PENDING = 0x4;     // PERSIST/EXCLUSIVE模式下没人等的时候事件来过了
+        static const uint32_t GEN_STEP = 0x8;
         struct EventContext {
-            Scheduler *scheduler;    // 待执行的scheduler
+            Scheduler *scheduler = nullptr;    // 待执行的scheduler
             Fiber::ptr fiber;        // 事件协程
             std::function<void()> cb;// 事件的回调函数
+            std::atomic<uint32_t> state = {IDLE};   // 代数<<2 | State
         };
 
         EventContext &getContext(Event event);
-        void resetContext(EventContext &ctx);
-        void triggerEvent(Event event);
+        int armedEvents();                                  // 处于ARMED的事件
+        uint32_t claim(Event event, uint32_t expect = 0);   // ARMED抢成FIRING，返回抢到前的状态字，没抢到返回0；expect不为0时只抢这一代
+        bool fire(Event event);                             // epoll报了事件，抢到就触发，PERSIST/EXCLUSIVE模式下没抢到就记成PENDING
+        bool latched() const { return mode == PERSIST || mode == EXCLUSIVE; }   // 注册一次就不再epoll_ctl的模式
+        void resetContext(Event event);                     // 抢到之后直接丢掉，回到IDLE
+        void triggerEvent(Event event);                     // 抢到之后调度，回到IDLE
 
         int fd;                // 事件关联的句柄
+        std::atomic<int> owner = {-1};   // 注册在哪个Reactor(epoll)上，第一次注册时决定，之后不变，同一个fd不会同时在两个epoll里
         EventContext read;     // 读事件
         EventContext write;    // 写事件
-        Event events = NONE;   // 已经注册的事件
-        MutexType mutex;
+        std::atomic<int> mode = {EDGE};            // EventMode
+        std::atomic<bool> registered = {false};    // 非EDGE模式下是否已经加到epoll里了
+        std::atomic<ZeroCopy *> zerocopy = {nullptr};
+
+        ~FdContext() { delete zerocopy.load(); }
+    };
+
+    // 一个epoll实例和唤醒它用的eventfd；共享模式下所有线程共用一个，per_thread模式下每个线程一个
+    struct Reactor {
+        int epfd = -1;
+        int tickleFd = -1;                  // eventfd，计数就是还没被线程取走的唤醒次数
+        std::atomic<size_t> tickled = {0};  // 还没被取走的唤醒次数，不超过idle线程数，多了就不用再写
+        std::atomic<size_t> idle = {0};     // 在idle里(可能睡在epoll_wait上)的线程数
     };
 public:
     IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "");
     ~IOManager();
 
-    // 1 success, 0 retry -1 error
+    // 1 success, 0 retry -1 error(errno是失败的原因)
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    // 和addEvent一样，但这个事件已经有别的协程在等时不断言，返回-1，errno=EBUSY
+    int tryAddEvent(int fd, Event event, std::function<void()> cb = nullptr);
     bool delEvent(int fd, Event event);     // 删除事件
     bool cancleEvent(int fd, Event event);  // 取消事件，并把触发事件的条件取消掉
-    bool cancleAllEvent(int fd);
+    bool cancleAllEvent(int fd);            // 关闭fd之前调用，非EDGE模式下会把fd从epoll里删掉
+    // 设置fd的注册方式，有事件在等的时候不能改；没设置过的fd用iomanager.event_mode配置的
+    bool setEventMode(int fd, EventMode mode);
+
+    // 直接提交读写/accept/connect，完成时恢复当前协程，返回值和errno与对应的系统调用一致
+    // io_uring后端下直接交给内核异步执行；epoll后端下退化为 非阻塞调用 + addEvent等待
+    ssize_t asyncRead(int fd, void *buf, size_t count);
+    ssize_t asyncWrite(int fd, const void *buf, size_t count);
+    int asyncAccept(int fd, sockaddr *addr, socklen_t *addrlen);
+    int asyncConnect(int fd, const sockaddr *addr, socklen_t addrlen);
+
+    bool isUring() const { return m_uring != nullptr; }
+
+    // MSG_ZEROCOPY发送(只支持epoll后端的TCP socket)：enableZeroCopy设置SO_ZEROCOPY，并把fd改成PERSIST一直留在epoll里，
+    // 完成通知从socket的错误队列里来，idle里读出来。fd上有事件在等的时候开不了
+    bool enableZeroCopy(int fd);
+    // 在本IOManager的协程里调用，发完全部数据才返回(EAGAIN的时候挂起)，出错返回-1。内核不再引用buf之后调用一次release(可能在别的线程)，
+    // 没开zerocopy、小于iomanager.zerocopy_min_size、或者内核的通知攒太多(ENOBUFS)的时候拷贝着发，release在返回前调用
+    ssize_t sendZeroCopy(int fd, const void *buf, size_t len, std::function<void()> release);
+    // 挂起直到这个fd上所有zerocopy发送都完成；关闭fd之前要调用，关闭时还没完成的会直接release并打告警
+    void flushZeroCopy(int fd);
+
+    struct ZeroCopyStats {
+        uint64_t sends = 0;        // 带MSG_ZEROCOPY的send次数
+        uint64_t completions = 0;  // 完成通知覆盖的send次数
+        uint64_t copied = 0;       // 其中内核实际上还是拷贝了的(比如发往本机)
+        uint64_t fallbacks = 0;    // 直接拷贝着发的sendZeroCopy调用次数
+    };
+    ZeroCopyStats getZeroCopyStats();
+
+    // idle循环的统计，用来评估busy poll模式的cpu开销
+    struct PollStats {
+        uint64_t loops = 0;        // idle循环次数(每次epoll_wait算一次)
+        uint64_t emptyPolls = 0;   // epoll_wait一个事件都没拿到的次数
+        uint64_t events = 0;       // 拿到的事件总数
+        uint64_t ctls = 0;         // epoll_ctl调用次数
+        uint64_t batch[8] = {0};   // 每次拿到的事件数的分布: 1, 2~3, 4~7, ..., 128以上
+    };
+    PollStats getPollStats();
+
+    // 按2的幂分桶的直方图：第0个桶是0，第i个桶是[2^(i-1), 2^i)，最后一个桶收下所有更大的
+    struct LoopHistogram {
+        static const int BUCKETS = 24;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        uint64_t buckets[BUCKETS] = {0};
+
+        void merge(const LoopHistogram &other);
+        uint64_t percentile(double p) const;    // 所在桶的上界，p取0~1
+    };
+    // 一个线程的事件循环统计，iomanager.loop_stats打开时才采集
+    struct LoopStats {
+        int threadId = 0;
+        uint64_t loops = 0;           // idle循环次数
+        uint64_t tickleWakeups = 0;   // 读到eventfd(被tickle叫醒)的次数
+        LoopHistogram waitUs;         // 每次睡在epoll_wait/io_uring_enter里的时间
+        LoopHistogram events;         // 每次拿到的事件数
+        LoopHistogram timerLagUs;     // 定时器预定时间到被事件循环取出来的延迟
+        LoopHistogram runUs;          // 每次离开idle去运行协程、到再回到idle的时间
+    };
+    struct LoopSnapshot {
+        std::vector<LoopStats> threads;
+        uint64_t pendingEvents = 0;   // 当前在等的事件数(m_pendingEventCount)
+        uint64_t tickles = 0;         // tickle()调用次数
+        uint64_t tickleWrites = 0;    // 真正写了eventfd的次数，其余的被合并掉了
+    };
+    LoopSnapshot getLoopStats();
+
+    // 信号交给事件循环处理，cb作为普通任务调度执行(不在信号处理函数里跑，可以随便用锁和协程)。只支持epoll后端
+    // 调用线程会屏蔽signo，之后创建的线程继承屏蔽，这些信号从signalfd读出来；没屏蔽的线程收到时由一个转发的处理函数交给事件循环
+    // 同一个信号连续来多次可能合并成一次回调；一个信号只能注册在一个IOManager上，再注册就替换掉cb
+    bool addSignal(int signo, std::function<void()> cb);
+    bool delSignal(int signo);    // 恢复原来的处理方式，并解除调用线程的屏蔽
     static IOManager *GetThis();
 protected:
     void tickle() override;
     bool stopping() override;
     void idle() override;
-    void onTimerInsertAtFront() override;
+    void onTimerInsertAtFront(size_t queue) override;
+    size_t getTimerQueue() override;
+    size_t pickTimerQueue() override;
     bool stopping(uint64_t &timeout);
 
-    void contextResize(size_t size);
 private:
-    int m_epfd = 0;   // epoll_fd
-    int m_tickleFds[2];
+    // fd上下文表是两级的：第一级固定大小，第二级按块懒分配，分配后不会移动，查找不用加锁
+    FdContext *getFdContext(int fd, bool auto_create = false);
+    int getReactorIndex();              // 当前线程对应的Reactor下标，不是本IOManager的线程返回-1
+    int armEvent(int fd, Event event, std::function<void()> &&cb, bool try_only);    // addEvent/tryAddEvent的实现
+    int pickOwner(int fd);              // fd第一次注册时决定交给哪个Reactor
+    void tickleReactor(Reactor *r);
+    void idleEpoll();
+    void idleUring();
+    bool syncEpoll(FdContext *fd_ctx, bool try_add);
+    int epollCtl(int epfd, int op, FdContext *fd_ctx, uint32_t events);
+    bool epollRegister(FdContext *fd_ctx);      // PERSIST/EXCLUSIVE模式第一次注册
+    void epollUnregister(FdContext *fd_ctx);    // 非EDGE模式从epoll里删掉
+    bool uringPollAdd(FdContext *fd_ctx, Event event, uint32_t state);
+    bool uringPollRemove(FdContext *fd_ctx, Event event, uint32_t state);
+    void uringFlush();
+    void uringComplete(const io_uring_cqe &cqe);
+    struct LoopCounters;
+    LoopCounters *newLoopCounters();          // 没开统计返回nullptr
+    void handleSignals();                     // 取出到达的信号，调度它们的回调
+    bool reapZeroCopy(FdContext *fd_ctx);       // 读错误队列里的完成通知，读到了返回true
+    void completeZeroCopy(ZeroCopy *zc, uint32_t lo, uint32_t hi, bool copied);
+    void resetZeroCopy(FdContext *fd_ctx);      // fd要关了，还没完成的直接release
+    int uringSubmitAndWait(io_uring_sqe &sqe);
+private:
+    std::vector<Reactor *> m_reactors;
+    std::atomic<size_t> m_reactorCount = {0};   // 已经分配出去的Reactor下标
+    std::atomic<size_t> m_tickleIndex = {0};    // 轮流唤醒各个Reactor
+    std::atomic<size_t> m_timerQueueIndex = {0};    // 不在事件循环里的线程加的定时器轮流放到各个线程的队列
 
     std::atomic<size_t> m_pendingEventCount = {0};
-    RWMutexType m_mutex;
-    std::vector<FdContext *> m_fdContexts;   // 每个句柄有个上下文
+    static const int FD_CHUNK_SHIFT = 10;                          // 每块1024个fd
+    static const int FD_CHUNK_SIZE = 1 << FD_CHUNK_SHIFT;
+    static const int FD_CHUNK_COUNT = 4096;                        // 最多支持4M个fd
+    std::atomic<std::atomic<FdContext *> *> m_fdChunks[FD_CHUNK_COUNT];   // 每个句柄有个上下文，用到时才创建
+    IOUring::ptr m_uring;    // 不为空时用io_uring后端，否则用epoll
+
+    uint32_t m_busyPollThreads = 0;                // 前几个进idle的线程用epoll_wait(0)空转，不睡眠
+    std::atomic<uint32_t> m_busyPollAssigned = {0};
+    int m_soBusyPoll = 0;                          // busy poll模式下给socket设置的SO_BUSY_POLL(微秒)
+    std::atomic<uint64_t> m_pollLoops = {0};
+    std::atomic<uint64_t> m_pollEmpty = {0};
+    std::atomic<uint64_t> m_pollEvents = {0};
+    std::atomic<uint64_t> m_epollCtls = {0};
+    EventMode m_defaultEventMode = EDGE;
+    uint32_t m_zeroCopyMinSize = 0;
+    std::atomic<uint64_t> m_zcSends = {0};
+    std::atomic<uint64_t> m_zcCompletions = {0};
+    std::atomic<uint64_t> m_zcCopied = {0};
+    std::atomic<uint64_t> m_zcFallbacks = {0};
+    std::atomic<uint64_t> m_pollBatch[8];
+    bool m_loopStats = false;
+    Mutex m_loopMutex;
+    std::vector<LoopCounters *> m_loopCounters;   // 每个跑过idle的线程一份，只有它自己写
+    std::atomic<uint64_t> m_tickles = {0};
+    std::atomic<uint64_t> m_tickleWrites = {0};
+    Mutex m_signalMutex;
+    std::map<int, std::function<void()>> m_signals;
+    int m_signalFd = -1;        // signalfd，屏蔽了的信号从这里读
+    int m_signalWakeFd = -1;    // eventfd，没屏蔽的线程收到信号时由处理函数写它
 };
 
 }
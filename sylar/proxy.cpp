@@ -0,0 +1,59 @@
+#include "proxy.h"
+#include "hook.h"
+
+#include <errno.h>
+
+namespace sylar {
+
+ssize_t proxy(int fd_in, int fd_out, size_t chunk)
+{
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC)) {
+        return -1;
+    }
+    // 管道默认64K，一次搬的比这个多的话把管道调大，调不了就按管道的大小搬
+    if (chunk > 64 * 1024) {
+        int sz = fcntl(pipefd[1], F_SETPIPE_SZ, (int)chunk);
+        if (sz > 0 && (size_t)sz < chunk) {
+            chunk = sz;
+        } else if (sz < 0) {
+            chunk = 64 * 1024;
+        }
+    }
+
+    // 每次都把管道里的数据全部写出去以后再从fd_in读，所以往管道里写的时候管道一定是空的，
+    // splice的EAGAIN只可能是fd_in没数据或者fd_out写满，hook里会等对应的那一端
+    ssize_t total = 0;
+    int err = 0;
+    while (true) {
+        ssize_t n = splice(fd_in, nullptr, pipefd[1], nullptr, chunk, SPLICE_F_MOVE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            err = errno;
+            break;
+        }
+        while (n > 0) {
+            ssize_t m = splice(pipefd[0], nullptr, fd_out, nullptr, n, SPLICE_F_MOVE);
+            if (m <= 0) {
+                err = m < 0 ? errno : EIO;
+                break;
+            }
+            n -= m;
+            total += m;
+        }
+        if (err) {
+            break;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return total;
+}
+
+}
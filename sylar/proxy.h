@@ -0,0 +1,17 @@
+#ifndef __SYLAR_PROXY_H__
+#define __SYLAR_PROXY_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+namespace sylar {
+
+// 用一对管道+splice把fd_in读到的数据原样写到fd_out，数据不经过用户态，一直到fd_in读到EOF
+// 单向的，双向代理开两个协程各跑一个方向；读到EOF之后不会关闭/shutdown fd_out，由调用方决定
+// 在IOManager的协程里调用时等待只挂起协程(走hook的splice)
+// 返回转发的字节数，出错返回-1并设置errno(已经转发的字节数就拿不到了)
+ssize_t proxy(int fd_in, int fd_out, size_t chunk = 64 * 1024);
+
+}
+
+#endif
@@ -2,15 +2,37 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
 
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+// next槽连续执行的上限，为0表示关闭next槽
+static ConfigVar<uint32_t>::ptr g_scheduler_next_max_streak =
+    Config::Lookup<uint32_t>("scheduler.next_max_streak", 16, "scheduler runnext max streak");
+
+static uint32_t s_next_max_streak = 16;
+struct _SchedulerIniter {
+    _SchedulerIniter() {
+        s_next_max_streak = g_scheduler_next_max_streak->getValue();
+        g_scheduler_next_max_streak->addListener([](const uint32_t &old_value, const uint32_t &new_value) {
+            SYLAR_LOG_INFO(g_logger) << "scheduler next max streak changed from "
+                                     << old_value << " to " << new_value;
+            s_next_max_streak = new_value;
+        });
+    }
+};
+
+static _SchedulerIniter s_scheduler_initer;
+
 static thread_local Scheduler *t_scheduler = nullptr;   // 协程调度器指针
 
 static thread_local Fiber *t_fiber = nullptr;           
 
+thread_local Scheduler::FiberAndThread Scheduler::t_next;
+thread_local uint32_t Scheduler::t_nextStreak = 0;
+
 // 创建一个协程，创建的协程执行run方法，但这个协程还未被执行起来
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) : m_name(name)
 {
@@ -130,11 +152,82 @@ void Scheduler::stop()
     }
 }
 
+void Scheduler::switchTo(int thread)
+{
+    SYLAR_ASSERT(Scheduler::GetThis() != nullptr);
+    if (Scheduler::GetThis() == this) {
+        if (thread == -1 || thread == sylar::GetThreadId()) {
+            return;
+        }
+    }
+    // 把自己放到目标调度器的队列里再让出去，目标调度器会在当前协程swapOut(状态不再是EXEC)之后再执行它
+    schedule(Fiber::GetThis(), thread);
+    Fiber::YieldToHold();
+}
+
 void Scheduler::setThis()
 {
     t_scheduler = this;
 }
 
+// 只有在本调度器的线程里、由正在执行的任务协程(不是线程主协程，也不是run所在的协程)发起的调度才放进next槽
+bool Scheduler::canScheduleNext(int threadId)
+{
+    if (!s_next_max_streak || GetThis() != this || !t_fiber) {
+        return false;
+    }
+    if (threadId != -1 && threadId != sylar::GetThreadId()) {
+        return false;
+    }
+    uint64_t id = Fiber::GetFiberId();
+    return id != 0 && id != t_fiber->getId();
+}
+
+void Scheduler::scheduleNext(const FiberAndThread &ft)
+{
+    if (!ft.fiber && !ft.cb) {
+        return;
+    }
+    FiberAndThread old = t_next;
+    t_next = ft;
+    if (!old.fiber && !old.cb) {
+        ++m_nextCount;
+        return;
+    }
+    // 被挤出来的任务放到全局队列，让其他线程也有机会执行
+    bool need_tickle = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        need_tickle = m_fibers.empty();
+        m_fibers.push_back(old);
+    }
+    if (need_tickle) {
+        tickle();
+    }
+}
+
+bool Scheduler::takeNext(FiberAndThread &ft)
+{
+    if (!t_next.fiber && !t_next.cb) {
+        return false;
+    }
+    if (t_next.fiber && t_next.fiber->getState() == Fiber::EXEC) {
+        // 协程在别的线程上还没切出去(比如刚注册完事件就被其他线程触发了)，交给全局队列去等它切出去
+        {
+            MutexType::Lock lock(m_mutex);
+            m_fibers.push_back(t_next);
+        }
+        t_next.reset();
+        --m_nextCount;
+        return false;
+    }
+    ft = t_next;
+    t_next.reset();
+    ++m_activeThreadCount;   // 先加活跃数再减next数，保证stopping()不会看到两个都是0
+    --m_nextCount;
+    return true;
+}
+
 void Scheduler::run()
 {
     SYLAR_LOG_INFO(g_logger) << "run";
@@ -150,7 +243,10 @@ void Scheduler::run()
         ft.reset();
         bool tickle_me = false;
         bool is_active = false;
-        {
+        if (t_nextStreak < s_next_max_streak && takeNext(ft)) {
+            ++t_nextStreak;
+            is_active = true;
+        } else {
             MutexType::Lock lock(m_mutex);
             auto it = m_fibers.begin();
             while (it != m_fibers.end()) {
@@ -171,6 +267,13 @@ void Scheduler::run()
                 break;
             }
             tickle_me |= it != m_fibers.end();
+            lock.unlock();
+            if (is_active) {
+                t_nextStreak = 0;
+            } else if (takeNext(ft)) {    // 全局队列没有可执行的任务，再回到next槽
+                t_nextStreak = 1;
+                is_active = true;
+            }
         }
         if (tickle_me) {
             tickle();
@@ -230,7 +333,8 @@ void Scheduler::tickle()
 bool Scheduler::stopping()
 {
     MutexType::Lock lock(m_mutex);    // 因为用到了list容器的empty方法
-    return m_autoStop && m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    return m_autoStop && m_stopping && m_fibers.empty() && m_activeThreadCount == 0 && m_nextCount == 0
+            && m_switchOutCount == 0;
 }
 
 void Scheduler::idle()
@@ -241,4 +345,26 @@ void Scheduler::idle()
     }
 }
 
+SchedulerSwitcher::SchedulerSwitcher(Scheduler *target)
+{
+    m_caller = Scheduler::GetThis();
+    if (target) {
+        if (m_caller && m_caller != target) {
+            ++m_caller->m_switchOutCount;   // 协程还要切回来，原调度器在这之前不能停
+            m_switched = true;
+        }
+        target->switchTo();
+    }
+}
+
+SchedulerSwitcher::~SchedulerSwitcher()
+{
+    if (m_caller) {
+        m_caller->switchTo();
+    }
+    if (m_switched) {
+        --m_caller->m_switchOutCount;
+    }
+}
+
 }
\ No newline at end of file
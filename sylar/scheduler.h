@@ -11,6 +11,8 @@
 namespace sylar {
 
 class Scheduler {
+friend class SchedulerSwitcher;
+friend class FileIOPool;
 public:
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
@@ -24,6 +26,9 @@ public:
     virtual ~Scheduler();    // 这个Scheduler类只是基类，后面会根据具体的特性，实现不同的子类
 
     const std::string &getName() const { return m_name; }
+    // 调度线程的id，use_caller的时候包括构造调度器的线程(它只在stop()里参与调度)
+    const std::vector<int> &getThreadIds() const { return m_threadIds; }
+    int getRootThreadId() const { return m_rootThreadId; }    // use_caller的线程id，没有是-1
 
     static Scheduler *GetThis();   // 获取当前协程调度器
     static Fiber *GetMainFiber();  // 需要一个main协程来管理调度器
@@ -31,8 +36,15 @@ public:
     void start();     // 启动线程池
     void stop();     
 
+    // 把当前正在执行的协程挪到本调度器(的thread线程)上继续执行，返回时已经在新调度器的线程里了
+    void switchTo(int thread = -1);
+
     template<class FiberOrCb> 
     void schedule(FiberOrCb fc, int threadId = -1) {
+        if (canScheduleNext(threadId)) {    // 本线程内唤醒的任务，优先放到本线程的next槽里，下一个就执行它
+            scheduleNext(FiberAndThread(fc, threadId));
+            return;
+        }
         bool need_tickle = false;
         {
             MutexType::Lock lokc(m_mutex);
@@ -77,6 +89,11 @@ private:
         }
         return need_tickle;
     }
+private:
+    struct FiberAndThread;
+    bool canScheduleNext(int threadId);
+    void scheduleNext(const FiberAndThread &ft);   // 放入next槽，槽里原来的任务挤到全局队列的队尾
+    bool takeNext(FiberAndThread &ft);             // 从next槽里取任务
 private:
     // 需要执行的协程对象
     struct FiberAndThread {
@@ -103,6 +120,10 @@ private:
             threadId = -1;
         }
     };
+
+    // 每个线程一个next槽(类似go的runnext)，线程同一时刻只属于一个调度器，所以用线程局部变量就够了
+    static thread_local FiberAndThread t_next;
+    static thread_local uint32_t t_nextStreak;     // 连续从next槽取任务的次数，超过上限就先去全局队列取，防止互相唤醒的两个协程饿死别人
 private:
     MutexType m_mutex;   // 互斥量
     std::vector<Thread::ptr> m_threads;   // 线程池
@@ -114,11 +135,26 @@ protected:
     size_t m_threadCount = 0;
     std::atomic<size_t> m_activeThreadCount = {0};
     std::atomic<size_t> m_idleThreadCount = {0};     // 在IOManager中可以直接访问使用这些属性，但是private就不行，必须要通过public方法调用
+    std::atomic<size_t> m_nextCount = {0};           // 各线程next槽里还没执行的任务数
+    std::atomic<size_t> m_switchOutCount = {0};      // 通过SchedulerSwitcher临时切走或者交给FileIOPool、之后还要切回来的协程数
     bool m_stopping = true;
     bool m_autoStop = false;       // 是否主动停止
     int m_rootThreadId = 0;    // usecaller的id
 };
 
+// 作用域内切换到target调度器上执行，出作用域时切回原来的调度器
+class SchedulerSwitcher {
+public:
+    SchedulerSwitcher(Scheduler *target = nullptr);
+    ~SchedulerSwitcher();
+private:
+    SchedulerSwitcher(const SchedulerSwitcher &) = delete;
+    SchedulerSwitcher &operator=(const SchedulerSwitcher &) = delete;
+private:
+    Scheduler *m_caller;
+    bool m_switched = false;
+};
+
 }
 
 #endif
\ No newline at end of file
@@ -1,45 +1,277 @@
 #include "timer.h"
+#include "log.h"
+#include "macro.h"
+#include "config.h"
+
+#include <string.h>
+#include <atomic>
+#include <algorithm>
 
 namespace sylar {
 
-bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const 
+// 类似linux的timerslack：定时器可以晚这么多微秒到期，换来时间相近的定时器合并成一次唤醒；0是精确到期
+static ConfigVar<uint64_t>::ptr g_timer_slack_us =
+    Config::Lookup<uint64_t>("timer.slack_us", 0, "timer default slack in us");
+
+// 一个线程的定时器：分层时间轮，每层64个槽，第level层一个槽覆盖2^(6*level)微秒
+// 只有拥有它的线程取到期的定时器；加/删/改可以来自任何线程，都锁m_mutex
+class TimerQueue {
+public:
+    enum {
+        WHEEL_BITS = 6,
+        WHEEL_SLOTS = 1 << WHEEL_BITS,
+        WHEEL_LEVELS = (64 + WHEEL_BITS - 1) / WHEEL_BITS
+    };
+    typedef Mutex MutexType;
+
+    TimerQueue(size_t index);
+    ~TimerQueue();
+
+    // 下面几个都要先持有m_mutex
+    bool insert(Timer *timer);    // 放进时间轮，返回是否要唤醒事件循环
+    void link(Timer *timer);
+    void unlink(Timer *timer);
+    uint64_t earliest();    // 最早到期的时间(槽里定时器太多的时候是槽的起始时间)，没有定时器返回~0ull
+    static uint64_t Expires(const Timer *timer);
+public:
+    size_t m_index;
+    MutexType m_mutex;
+    Timer *m_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t m_occupied[WHEEL_LEVELS];    // 每层哪些槽非空
+    uint64_t m_current = 0;               // 时间轮走到的时间(微秒)
+    // 下面几个不加锁也能读：事件循环靠它们判断有没有到期、要睡多久，不用每圈都去抢锁
+    std::atomic<size_t> m_count = {0};
+    std::atomic<uint64_t> m_wakeAt = {~0ull};     // 不晚于最早到期的定时器
+    std::atomic<bool> m_tickled = {false};        // 事件循环算完等待时间以后是否已经被唤醒过
+};
+
+static thread_local uint64_t t_now = 0;    // 事件循环缓存的单调时钟，0表示没有缓存
+
+// 每个线程缓存一些释放掉的定时器内存块(Timer和shared_ptr控制块在同一块里)，加定时器时不用每次都malloc
+// 在别的线程释放的块进那个线程的缓存；线程退出时缓存还给系统
+struct TimerSlab {
+    static const size_t MAX_FREE = 4096;
+    void *free = nullptr;
+    size_t count = 0;
+    size_t size = 0;    // 块大小，只缓存第一次见到的大小
+
+    ~TimerSlab() {
+        while (free) {
+            void *next = *(void **)free;
+            ::operator delete(free);
+            free = next;
+        }
+    }
+};
+
+static thread_local TimerSlab *t_slab = nullptr;
+static thread_local bool t_slab_dead = false;    // 线程退出时缓存已经释放，之后的分配释放直接走系统
+
+struct TimerSlabGuard {
+    ~TimerSlabGuard() {
+        delete t_slab;
+        t_slab = nullptr;
+        t_slab_dead = true;
+    }
+};
+
+static TimerSlab *GetTimerSlab()
 {
-    if (!lhs && !rhs) {
-        return false;
-    } 
-    if (!lhs) {
-        return true;
+    if (!t_slab && !t_slab_dead) {
+        static thread_local TimerSlabGuard s_guard;    // 第一次用到时构造，线程退出时析构
+        (void)s_guard;
+        t_slab = new TimerSlab;
     }
-    if (!rhs) {
-        return false;
+    return t_slab;
+}
+
+template<class T>
+struct TimerAllocator {
+    typedef T value_type;
+
+    TimerAllocator() {}
+    template<class U>
+    TimerAllocator(const TimerAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        size_t size = n * sizeof(T);
+        TimerSlab *slab = GetTimerSlab();
+        if (slab && slab->free && slab->size == size) {
+            void *p = slab->free;
+            slab->free = *(void **)p;
+            --slab->count;
+            return (T *)p;
+        }
+        return (T *)::operator new(size);
     }
-    if (lhs->m_next < rhs->m_next) {
-        return true;
+
+    void deallocate(T *p, size_t n) {
+        size_t size = n * sizeof(T);
+        TimerSlab *slab = GetTimerSlab();
+        if (slab && slab->count < TimerSlab::MAX_FREE && (!slab->size || slab->size == size)) {
+            slab->size = size;
+            *(void **)p = slab->free;
+            slab->free = p;
+            ++slab->count;
+            return;
+        }
+        ::operator delete(p);
     }
-    if (rhs->m_next < lhs->m_next) {
-        return false;
+
+    // Timer的构造函数是私有的，要在这里构造
+    template<class U, class... Args>
+    void construct(U *p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
     }
-    return lhs.get() < rhs.get();
+    template<class U>
+    void destroy(U *p) {
+        p->~U();
+    }
+};
+
+template<class T, class U>
+bool operator==(const TimerAllocator<T> &, const TimerAllocator<U> &) { return true; }
+template<class T, class U>
+bool operator!=(const TimerAllocator<T> &, const TimerAllocator<U> &) { return false; }
+
+TimerQueue::TimerQueue(size_t index)
+    : m_index(index)
+{
+    memset(m_wheel, 0, sizeof m_wheel);
+    memset(m_occupied, 0, sizeof m_occupied);
+    m_current = TimerManager::Now();
 }
 
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager *manager)
-    : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager)
+TimerQueue::~TimerQueue()
 {
-    m_next = sylar::GetCurrentMS() + m_ms;
+    // 还挂着的定时器自己持有自己，这里把环断开
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            Timer *timer = m_wheel[level][slot];
+            while (timer) {
+                Timer *next = timer->m_nextTimer;
+                timer->m_prevTimer = timer->m_nextTimer = nullptr;
+                timer->m_bucket = nullptr;
+                timer->m_self.reset();
+                timer = next;
+            }
+        }
+    }
 }
 
-Timer::Timer(uint64_t next) : m_next(next)
+// 真正到期的时间：m_next按slack向上对齐，对齐粒度是不超过slack的最大的2的幂
+uint64_t TimerQueue::Expires(const Timer *timer)
 {
+    if (!timer->m_slack) {
+        return timer->m_next;
+    }
+    uint64_t granularity = 1ull << (63 - __builtin_clzll(timer->m_slack));
+    uint64_t expires = (timer->m_next + granularity - 1) & ~(granularity - 1);
+    return expires < timer->m_next ? timer->m_next : expires;
+}
 
+// 每次添加timer前先判断是不是比事件循环打算醒来的时间还早
+bool TimerQueue::insert(Timer *timer)
+{
+    uint64_t wake_at = m_wakeAt;
+    link(timer);
+    // 比原来最早的还早，就要去唤醒一下事件循环；m_tickled在link改完m_wakeAt之后才读，和getNextTimerUs的顺序正好相反，两边总有一边看得到另一边
+    return Expires(timer) < wake_at && !m_tickled.exchange(true);
+}
+
+void TimerQueue::link(Timer *timer)
+{
+    // 按到期时间和当前时间最高的不同位决定放在哪层，这一层的槽号就是到期时间在这一层的那几位
+    uint64_t t = std::max(Expires(timer), m_current + 1);
+    int level = (63 - __builtin_clzll(t ^ m_current)) / WHEEL_BITS;
+    int shift = level * WHEEL_BITS;
+    int slot = (t >> shift) & (WHEEL_SLOTS - 1);
+    Timer **bucket = &m_wheel[level][slot];
+    timer->m_prevTimer = nullptr;
+    timer->m_nextTimer = *bucket;
+    if (*bucket) {
+        (*bucket)->m_prevTimer = timer;
+    }
+    *bucket = timer;
+    timer->m_bucket = bucket;
+    m_occupied[level] |= 1ull << slot;
+    m_count.store(m_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (t < m_wakeAt) {
+        m_wakeAt = t;
+    }
+}
+
+void TimerQueue::unlink(Timer *timer)
+{
+    Timer **bucket = timer->m_bucket;
+    if (timer->m_prevTimer) {
+        timer->m_prevTimer->m_nextTimer = timer->m_nextTimer;
+    } else {
+        *bucket = timer->m_nextTimer;
+    }
+    if (timer->m_nextTimer) {
+        timer->m_nextTimer->m_prevTimer = timer->m_prevTimer;
+    }
+    if (!*bucket) {
+        size_t index = bucket - &m_wheel[0][0];
+        m_occupied[index / WHEEL_SLOTS] &= ~(1ull << (index % WHEEL_SLOTS));
+    }
+    timer->m_prevTimer = timer->m_nextTimer = nullptr;
+    timer->m_bucket = nullptr;
+    m_count.store(m_count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    // m_wakeAt只要不晚于最早的定时器就行，摘掉定时器不用改，最多事件循环白醒一次
+}
+
+uint64_t TimerQueue::earliest()
+{
+    // 低层的槽都在高层下一个槽开始之前，所以最低的非空层里当前位置之后的第一个槽就是最早的
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        uint64_t occupied = m_occupied[level];
+        if (!occupied) {
+            continue;
+        }
+        int shift = level * WHEEL_BITS;
+        uint64_t base = m_current >> shift;
+        int from = (base + 1) & (WHEEL_SLOTS - 1);
+        uint64_t rotated = from ? (occupied >> from) | (occupied << (WHEEL_SLOTS - from)) : occupied;
+        uint64_t slot = base + 1 + __builtin_ctzll(rotated);
+        uint64_t start = (slot > (~0ull >> shift)) ? ~0ull : slot << shift;
+        if (!level) {
+            return start;
+        }
+        // 高层的槽要到期的时候才需要级联，醒在槽里最早的定时器上，不用在槽开始时白醒一次；槽里太多就不找了
+        static const int MAX_SCAN = 64;
+        uint64_t next = ~0ull;
+        int n = 0;
+        for (Timer *timer = m_wheel[level][slot & (WHEEL_SLOTS - 1)]; timer; timer = timer->m_nextTimer) {
+            if (++n > MAX_SCAN) {
+                return start;
+            }
+            next = std::min(next, std::max(Expires(timer), start));
+        }
+        return next;
+    }
+    return ~0ull;
+}
+
+Timer::Timer(uint64_t us, std::function<void()> &&cb, bool recurring, TimerManager *manager)
+    : m_recurring(recurring), m_us(us), m_cb(std::move(cb)), m_manager(manager)
+{
+    m_next = TimerManager::Now() + m_us;
 }
 
 bool Timer::cancle()
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    Timer::ptr self = shared_from_this();    // 摘下来以后m_self就放掉了，先保证函数返回前不会析构
+    TimerQueue::MutexType::Lock lock(m_queue->m_mutex);
     if (m_cb) {
         m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());   // 找到这个定时器
-        m_manager->m_timers.erase(it);
+        m_armed.store(false, std::memory_order_release);
+        if (m_bucket) {
+            m_queue->unlink(this);
+        }
+        m_self.reset();
         return true;
     }
     return false;
@@ -48,165 +280,279 @@ bool Timer::cancle()
 // 重置时间
 bool Timer::refresh()
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (!m_cb) {
-        return false;
+    if (m_lazy) {
+        if (!m_armed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        m_lazyNext.store(TimerManager::Now() + m_us, std::memory_order_relaxed);
+        return true;
     }
-    auto it = m_manager->m_timers.find(shared_from_this());    // 找到这个定时器
-    if (it == m_manager->m_timers.end()) {
+    TimerQueue::MutexType::Lock lock(m_queue->m_mutex);
+    if (!m_cb || !m_bucket) {
         return false;
     }
-    // 为什么要先删除再添加回去呢？因为operator是基于next来做的，如果改时间的话，会影响比较位置
-    // 重置时间一定是比当前时间要大，要往后走，不会走到它前面，所以不用addTimer去判断是否会加到m_timers前面
-    m_manager->m_timers.erase(it);
-    m_next = sylar::GetCurrentMS() + m_ms;
-    m_manager->m_timers.insert(shared_from_this());
+    // 重置时间一定是比当前时间要大，要往后走，不会走到它前面，所以不用去判断是否要唤醒
+    m_queue->unlink(this);
+    m_next = TimerManager::Now() + m_us;
+    m_queue->link(this);
     return true;
 }
 
 bool Timer::reset(uint64_t ms, bool from_now)
 {
-    if (ms == m_ms && !from_now) {   // 立马强制改时间
+    return resetUs(ms * 1000, from_now);
+}
+
+bool Timer::resetUs(uint64_t us, bool from_now)
+{
+    if (us == m_us && !from_now) {   // 立马强制改时间
         return true;
     }
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (!m_cb) {
-        return false;
-    }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if (it == m_manager->m_timers.end()) {
+    TimerQueue::MutexType::Lock lock(m_queue->m_mutex);
+    if (!m_cb || !m_bucket) {
         return false;
     }
 
-    m_manager->m_timers.erase(it);
+    m_queue->unlink(this);
     uint64_t start = 0;
     if (from_now) {
-        start = sylar::GetCurrentMS();
+        start = TimerManager::Now();
     } else {
-        start = m_next - m_ms;
+        start = m_next - m_us;
+    }
+    m_us = us;
+    m_next = start + m_us;
+    m_lazyNext.store(0, std::memory_order_relaxed);
+    bool at_front = m_queue->insert(this);
+    lock.unlock();
+
+    if (at_front) {
+        m_manager->onTimerInsertAtFront(m_queue->m_index);
+    }
+    return true;
+}
+
+uint64_t TimerManager::Now()
+{
+    return t_now ? t_now : sylar::GetMonotonicUS();
+}
+
+uint64_t TimerManager::RefreshNow()
+{
+    t_now = sylar::GetMonotonicUS();
+    return t_now;
+}
+
+void TimerManager::ClearNow()
+{
+    t_now = 0;
+}
+
+bool Timer::setSlackUs(uint64_t us)
+{
+    TimerQueue::MutexType::Lock lock(m_queue->m_mutex);
+    if (!m_cb || !m_bucket) {
+        return false;
+    }
+    m_queue->unlink(this);
+    m_slack = us;
+    bool at_front = m_queue->insert(this);
+    lock.unlock();
+
+    if (at_front) {
+        m_manager->onTimerInsertAtFront(m_queue->m_index);
     }
-    m_ms = ms;
-    m_next = start + m_ms;
-    m_manager->addTimer(shared_from_this(), lock);
     return true;
 }
 
 TimerManager::TimerManager() {
-    m_preTime = sylar::GetCurrentMS();
+    m_queues.push_back(new TimerQueue(0));
+    m_slack = g_timer_slack_us->getValue();
 }
 
 TimerManager::~TimerManager()
 {
+    for (auto i : m_queues) {
+        delete i;
+    }
+}
 
+void TimerManager::setTimerQueues(size_t count)
+{
+    SYLAR_ASSERT(count > 0 && !hasTimer());
+    for (auto i : m_queues) {
+        delete i;
+    }
+    m_queues.clear();
+    for (size_t i = 0; i < count; ++i) {
+        m_queues.push_back(new TimerQueue(i));
+    }
 }
 
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring)
 {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
-    RWMutexType::WriteLock lock(m_mutex);
-    addTimer(timer, lock);
-    return timer;
+    return addTimerUs(ms * 1000, cb, recurring);
 }
 
-// weak_ptr好处是不用引用计数加1，但又可以知道我们所指向的那个指针是否已经释放了
-static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
+Timer::ptr TimerManager::addTimerUs(uint64_t us, std::function<void()> cb, bool recurring)
 {
-    // lock是返回一下这个weak_ptr的智能指针，如果释放就是空的，如果没释放就拿到了这个指针
-    std::shared_ptr<void> tmp = weak_cond.lock();
-    if (tmp) {
-        cb();
+    return newTimer(us, std::move(cb), nullptr, recurring);
+}
+
+Timer::ptr TimerManager::newTimer(uint64_t us, std::function<void()> &&cb, const std::weak_ptr<void> *cond, bool recurring)
+{
+    Timer::ptr timer = std::allocate_shared<Timer>(TimerAllocator<Timer>(), us, std::move(cb), recurring, this);
+    if (cond) {
+        timer->m_hasCond = true;
+        timer->m_cond = *cond;
+    }
+    timer->m_slack = m_slack;
+    TimerQueue *queue = m_queues[pickTimerQueue() % m_queues.size()];
+    timer->m_queue = queue;
+    timer->m_self = timer;
+    TimerQueue::MutexType::Lock lock(queue->m_mutex);
+    bool at_front = queue->insert(timer.get());
+    lock.unlock();
+
+    if (at_front) {
+        onTimerInsertAtFront(queue->m_index);    // 因为如果原来定时器定时10s，现在这个定时器3s后执行，那显然不能让原来定时器10s后再醒，不然就超出现在这个定时器时间了
     }
+    return timer;
 }
 
+// weak_ptr好处是不用引用计数加1，但又可以知道我们所指向的那个指针是否已经释放了；条件直接存在Timer里，到期时检查
 Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring)
 {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+    return newTimer(ms * 1000, std::move(cb), &weak_cond, recurring);
+}
+
+Timer::ptr TimerManager::addConditionTimerUs(uint64_t us, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring)
+{
+    return newTimer(us, std::move(cb), &weak_cond, recurring);
 }
 
 uint64_t TimerManager::getNextTimer()
 {
-    RWMutexType::ReadLock lock(m_mutex);   // 没有做修改，用读锁
-    m_tickled = false;
-    if (m_timers.empty()) {
+    uint64_t us = getNextTimerUs();
+    return us == ~0ull ? us : (us + 999) / 1000;    // 向上取整，不然epoll_wait会提前醒来空转一圈
+}
+
+uint64_t TimerManager::getNextTimerUs()
+{
+    // 不加锁：先清m_tickled再读m_wakeAt，之后插进来更早的定时器要么被这里读到，要么会去唤醒
+    TimerQueue *queue = m_queues[getTimerQueue() % m_queues.size()];
+    queue->m_tickled = false;
+    uint64_t next = queue->m_wakeAt;
+    if (next == ~0ull) {
         return ~0ull;   // 如果是空的，返回最大的
     }
 
-    // 否则就拿到首个定时器
-    const Timer::ptr &next = *m_timers.begin();
-    uint64_t now_ms = sylar::GetCurrentMS();
-    if (now_ms >= next->m_next) {    // 说明这个定时器需要执行了，但不知什么原因晚了，那就立马执行
+    uint64_t now_us = RefreshNow();    // 马上要按这个时间睡，必须是新读的
+    if (now_us >= next) {    // 说明这个定时器需要执行了，但不知什么原因晚了，那就立马执行
         return 0;
     } else {
-        return next->m_next - now_ms;   // 返回还要等待的时间
+        return next - now_us;   // 返回还要等待的时间
     }
 }
 
-void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs)
+void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs, std::vector<uint64_t> *lateness)
 {
-    uint64_t now_ms = sylar::GetCurrentMS();    // 获取当前时间
-    std::vector<Timer::ptr> expired;    // 存放已经超时的timer
-    {
-        RWMutexType::ReadLock lock(m_mutex);
-        if (m_timers.empty()) {    // 如果是空的，说明没有任何定时器要执行，就直接返回
-            return;
-        }
+    TimerQueue *queue = m_queues[getTimerQueue() % m_queues.size()];
+    uint64_t now_us = RefreshNow();    // 刚等完，读一次当前时间，这一圈后面都用它
+    // 最早的槽还没到，就没有要做的，不用抢锁
+    if (now_us < queue->m_wakeAt) {
+        return;
     }
-    RWMutex::WriteLock lock(m_mutex);    // 要用写锁，因为当如果真的有超时时间时，需要修改m_timers的
-
-    bool rollover = detectClockRollover(now_ms);
-    if (!rollover && ((*m_timers.begin())->m_next > now_ms)) {
+    TimerQueue::MutexType::Lock lock(queue->m_mutex);    // 要修改时间轮
+    if (now_us <= queue->m_current) {    // 单调时钟不会往回走，只可能是别的线程刚取过
         return;
     }
 
-    Timer::ptr now_timer(new Timer(now_ms));
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);    // 发现调过时间了，就直接重置
-    while (it != m_timers.end() && (*it)->m_next == now_ms) {
-        ++it;
+    // 每层把从m_current到now_us之间走过的槽整个摘下来
+    Timer *todo = nullptr;
+    size_t taken = 0;
+    for (int level = 0; level < TimerQueue::WHEEL_LEVELS; ++level) {
+        int shift = level * TimerQueue::WHEEL_BITS;
+        uint64_t from = queue->m_current >> shift;
+        uint64_t to = now_us >> shift;
+        if (to == from) {
+            break;    // 这一层还没走到下一个槽，更高的层也一样
+        }
+        uint64_t mask = ~0ull;
+        if (to - from < TimerQueue::WHEEL_SLOTS) {
+            int first = (from + 1) & (TimerQueue::WHEEL_SLOTS - 1);
+            mask = (1ull << (to - from)) - 1;
+            mask = first ? (mask << first) | (mask >> (TimerQueue::WHEEL_SLOTS - first)) : mask;
+        }
+        mask &= queue->m_occupied[level];
+        queue->m_occupied[level] &= ~mask;
+        while (mask) {
+            int slot = __builtin_ctzll(mask);
+            mask &= mask - 1;
+            Timer *timer = queue->m_wheel[level][slot];
+            queue->m_wheel[level][slot] = nullptr;
+            while (timer) {
+                Timer *next = timer->m_nextTimer;
+                timer->m_prevTimer = nullptr;
+                timer->m_bucket = nullptr;
+                timer->m_nextTimer = todo;
+                todo = timer;
+                ++taken;
+                timer = next;
+            }
+        }
     }
-    expired.insert(expired.begin(), m_timers.begin(), it);   // 把超时的需要执行的定时器放进去
-    m_timers.erase(m_timers.begin(), it);    // 在m_tiners里把这部分定时器删掉
-    cbs.reserve(expired.size());
+    queue->m_current = now_us;
+    queue->m_count -= taken;
 
-    for (auto &timer : expired) {
-        cbs.push_back(timer->m_cb);
-        if (timer->m_recurring) {      // 如果timer是循环定时器，那我们要重置它的时间，然后再把它重新加回到m_timers里
-            timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
+    // 到期的取出来，没到期的(高层的槽)按新的当前时间重新放，会落到更低的层
+    std::vector<Timer::ptr> expired;    // 存放已经超时的timer
+    while (todo) {
+        Timer *timer = todo;
+        todo = timer->m_nextTimer;
+        timer->m_nextTimer = nullptr;
+        if (TimerQueue::Expires(timer) <= now_us) {
+            uint64_t lazy = timer->m_lazyNext.load(std::memory_order_relaxed);
+            if (lazy > now_us) {    // 懒刷新推后了，按新的时间放回去
+                timer->m_next = lazy;
+                queue->link(timer);
+            } else {
+                expired.push_back(std::move(timer->m_self));
+            }
         } else {
-            timer->m_cb = nullptr;     // 设置为nullptr，是防止回调函数了用了智能指针，如果不置空的话，会使得引用计数不减1
+            queue->link(timer);
         }
     }
-}
+    cbs.reserve(cbs.size() + expired.size());
 
-// 每次添加timer前先判断是不是在前面
-void TimerManager::addTimer(Timer::ptr timer, RWMutex::WriteLock &lock)
-{
-    auto it = m_timers.insert(timer).first;   // m_timers用的是set，set是有序的，insert时可以返回这个数据的位置
-    bool at_front = (it == m_timers.begin()) && !m_tickled;  // 如果位于首部位置，说明是即将要执行的定时器，它就要去唤醒一下原来的定时器
-    if (at_front) {
-        m_tickled = true;
-    }
-    lock.unlock();
-
-    if (at_front) {
-        onTimerInsertAtFront();    // 因为如果原来定时器定时10s，现在这个定时器3s后执行，那显然不能让原来定时器10s后再醒，不然就超出现在这个定时器时间了
+    for (auto &timer : expired) {
+        if (!timer->m_hasCond || !timer->m_cond.expired()) {
+            cbs.push_back(timer->m_cb);
+        }
+        if (lateness) {
+            lateness->push_back(now_us > timer->m_next ? now_us - timer->m_next : 0);
+        }
+        if (timer->m_recurring) {      // 如果timer是循环定时器，那我们要重置它的时间，然后再把它重新放回时间轮里
+            timer->m_next = now_us + timer->m_us;
+            timer->m_lazyNext.store(0, std::memory_order_relaxed);
+            timer->m_self = timer;
+            queue->link(timer.get());
+        } else {
+            timer->m_armed.store(false, std::memory_order_release);
+            timer->m_cb = nullptr;     // 设置为nullptr，是防止回调函数了用了智能指针，如果不置空的话，会使得引用计数不减1
+        }
     }
+    queue->m_wakeAt = queue->earliest();    // 上面重新放的时候只会改小，这里重新算准
 }
 
 bool TimerManager::hasTimer()
 {
-    RWMutex::ReadLock lock(m_mutex);
-    return !m_timers.empty();     // 不是空的就说明有定时器
-}
-
-bool TimerManager::detectClockRollover(uint64_t now_ms)
-{
-    bool rollover = false;
-    if (now_ms < m_preTime && now_ms < (m_preTime - 60 * 60 + 1000)) {   // 当传进来的时间比它小，还比它一个小时前的时间小，那肯定是有问题的
-        rollover = true;
+    for (auto i : m_queues) {
+        if (i->m_count) {
+            return true;     // 不是空的就说明有定时器
+        }
     }
-    m_preTime = now_ms;
-    return rollover;
+    return false;
 }
 
-}
\ No newline at end of file
+}
@@ -1,65 +1,102 @@
 #ifndef __SYLAR_TIMER_H__
 #define __SYLAR_TIMER_H__
 
-#include <set>
 #include <memory>
 #include <vector>
-#include <set>
+#include <atomic>
 #include "thread.h"
 #include "util.h"
 
 namespace sylar {
 
 class TimerManager;
+class TimerQueue;
+template<class T> struct TimerAllocator;
 
 class Timer : public std::enable_shared_from_this<Timer> {
 friend class TimerManager;
+friend class TimerQueue;
+template<class T> friend struct TimerAllocator;
 public:
     typedef std::shared_ptr<Timer> ptr;
     bool cancle();
     bool refresh();
     bool reset(uint64_t ms, bool from_now);
+    bool resetUs(uint64_t us, bool from_now);
+    // 懒刷新：refresh只记下新的到期时间，不加锁也不动时间轮，到期时发现被推后了再重新放进去
+    // 适合每收一个包就刷新一次的空闲超时；已经取消或者执行过的refresh返回false，不能和reset同时调用
+    void setLazyRefresh(bool v) { m_lazy = v; }
+    // 允许晚到多少微秒：到期时间向上对齐到不超过slack的2的幂，对齐到同一时刻的定时器一起到期，只唤醒一次
+    bool setSlackUs(uint64_t us);
 private:
     // Timer对象不能自己创建，必须通过TimerManager来创建，所以我们给它设为私有
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager *manager);   
-    Timer(uint64_t next);
+    Timer(uint64_t us, std::function<void()> &&cb, bool recurring, TimerManager *manager);
 private:
     bool m_recurring = false;   // 是否循环计时器   循环计时：当前时间 + 定时时间
-    uint64_t m_ms = 0;          // 执行周期
-    uint64_t m_next = 0;        // 精确的执行时间
+    uint64_t m_us = 0;          // 执行周期(微秒)
+    uint64_t m_next = 0;        // 精确的执行时间(单调时钟，微秒)
     std::function<void()> m_cb;
     TimerManager *m_manager = nullptr;
-private:
-    struct Comparator {
-        bool operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const;
-    };
+    TimerQueue *m_queue = nullptr;    // 创建时所在线程的定时器队列，一直不变
+    // 时间轮的槽是侵入式双向链表，挂在槽上时m_bucket指向槽头，m_self持有自己，保证调用方丢掉指针以后定时器还在
+    Timer *m_prevTimer = nullptr;
+    Timer *m_nextTimer = nullptr;
+    Timer **m_bucket = nullptr;
+    Timer::ptr m_self;
+    uint64_t m_slack = 0;
+    bool m_lazy = false;
+    std::atomic<uint64_t> m_lazyNext = {0};    // 懒刷新记下的到期时间，0是没有
+    std::atomic<bool> m_armed = {true};        // 还没取消也没执行过，在锁里清掉，懒刷新不加锁看它
+    bool m_hasCond = false;         // 条件定时器：到期时条件已经释放了就不执行回调
+    std::weak_ptr<void> m_cond;
 };
 
+// 定时器按线程分成几个队列，每个队列是一个分层时间轮，有自己的锁；定时器放在创建它的线程的队列里，
+// 只由这个线程的事件循环取出来执行，别的线程取消/修改它时只锁这一个队列
 class TimerManager {
 friend class Timer;
 public:
-    typedef RWMutex RWMutexType;
-
     TimerManager();
     virtual ~TimerManager();
 
     Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    // 条件定时器到期时weak_cond已经释放了就不执行cb
     Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
-    uint64_t getNextTimer();    // 获取下一个定时器的执行时间
-    void listExpiredCb(std::vector<std::function<void()>> &cbs);  // 触发定时器后，返回那些已经超时的需要执行的cb
+    // 微秒精度的定时器，IOManager用epoll_pwait2等到微秒
+    Timer::ptr addTimerUs(uint64_t us, std::function<void()> cb, bool recurring = false);
+    Timer::ptr addConditionTimerUs(uint64_t us, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+    // 下面三个都只看当前线程的队列
+    uint64_t getNextTimer();    // 获取下一个定时器还要等多少毫秒(向上取整)，没有定时器返回~0ull
+    uint64_t getNextTimerUs();  // 同上，单位微秒；下一个定时器在高层的槽里时返回的是那个槽的起始时间，到时候级联以后再算
+    // 触发定时器后，返回那些已经超时的需要执行的cb；lateness不为空时顺便记下每个定时器比预定时间晚了多少微秒
+    void listExpiredCb(std::vector<std::function<void()>> &cbs, std::vector<uint64_t> *lateness = nullptr);
+
+    // 定时器用单调时钟(微秒)，事件循环每次算等待时间、取到期定时器时读一次缓存在线程里，这一圈里加的定时器都从这个时间算起
+    // 没在事件循环里的线程没有缓存，每次都读时钟
+    static uint64_t Now();
+    static uint64_t RefreshNow();    // 重新读时钟并缓存，跑了很久的任务里要精确计时(比如sleep)的先调一下
+    static void ClearNow();          // 事件循环退出时清掉缓存，这个线程之后再加定时器就直接读时钟
+
+    // 之后加的定时器默认的slack(微秒)，初始值是配置timer.slack_us，见Timer::setSlackUs
+    void setTimerSlackUs(uint64_t us) { m_slack = us; }
+    uint64_t getTimerSlackUs() const { return m_slack; }
 protected:  // 要与IO Event做交互
-    virtual void onTimerInsertAtFront() = 0;
-    void addTimer(Timer::ptr val, RWMutex::WriteLock &lock);
-    bool hasTimer();
+    // 第queue个队列来了一个比它原来最早的还早的定时器，要唤醒处理这个队列的线程
+    virtual void onTimerInsertAtFront(size_t queue) = 0;
+    // 当前线程的事件循环处理哪个队列(算等待时间、取到期定时器)，默认只有一个
+    virtual size_t getTimerQueue() { return 0; }
+    // 当前线程新加的定时器放到哪个队列，默认就是自己处理的那个
+    virtual size_t pickTimerQueue() { return getTimerQueue(); }
+    // 设置队列个数，只能在还没有定时器的时候调用
+    void setTimerQueues(size_t count);
+    bool hasTimer();    // 所有队列里还有没有定时器
 private:
-    bool detectClockRollover(uint64_t now_ms);  // 用于检测服务器是否调过时间
+    Timer::ptr newTimer(uint64_t us, std::function<void()> &&cb, const std::weak_ptr<void> *cond, bool recurring);
 private:
-    RWMutexType m_mutex;
-    std::set<Timer::ptr, Timer::Comparator> m_timers;   // 可以考虑用堆或者红黑树？(网友弹幕)
-    bool m_tickled = false;
-    uint64_t m_preTime;   // 服务器没有调过的上一个时间
+    std::vector<TimerQueue *> m_queues;
+    uint64_t m_slack = 0;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,133 @@
+#include "udp_batch.h"
+#include "hook.h"
+#include "log.h"
+#include "macro.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <errno.h>
+
+namespace sylar {
+
+// 每个报文的控制信息只放UDP_GRO(int)或者UDP_SEGMENT(uint16_t)
+static const size_t CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+static const size_t GSO_MAX_SEGMENTS = 64;     // 内核UDP_MAX_SEGMENTS
+
+UdpBatch::UdpBatch(size_t count, size_t buf_size)
+    : m_count(count)
+    , m_bufSize(buf_size)
+    , m_bufs(count * buf_size)
+    , m_msgs(count)
+    , m_iovs(count)
+    , m_addrs(count)
+    , m_controls(count * CONTROL_SIZE)
+    , m_segments(count)
+{
+    SYLAR_ASSERT(count > 0 && buf_size > 0);
+}
+
+void UdpBatch::prepare(size_t i, size_t len)
+{
+    m_iovs[i].iov_base = &m_bufs[i * m_bufSize];
+    m_iovs[i].iov_len = len;
+    msghdr &hdr = m_msgs[i].msg_hdr;
+    hdr.msg_name = &m_addrs[i];
+    hdr.msg_namelen = sizeof(sockaddr_storage);
+    hdr.msg_iov = &m_iovs[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = &m_controls[i * CONTROL_SIZE];
+    hdr.msg_controllen = CONTROL_SIZE;
+    hdr.msg_flags = 0;
+    m_msgs[i].msg_len = 0;
+    m_segments[i] = 0;
+}
+
+int UdpBatch::recv(int fd)
+{
+    m_pending = 0;
+    for (size_t i = 0; i < m_count; ++i) {
+        prepare(i, m_bufSize);
+    }
+    int n = recvmmsg(fd, &m_msgs[0], m_count, 0, nullptr);
+    for (int i = 0; i < n; ++i) {
+        msghdr &hdr = m_msgs[i].msg_hdr;
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int seg = 0;
+                memcpy(&seg, CMSG_DATA(cm), sizeof seg);
+                m_segments[i] = seg;
+            }
+        }
+    }
+    return n;
+}
+
+bool UdpBatch::add(const void *data, size_t len, const sockaddr *addr, socklen_t addrlen)
+{
+    SYLAR_ASSERT(len <= m_bufSize && addrlen <= sizeof(sockaddr_storage));
+    // GSO: 前面的每一段都正好是m_gso、目的地址一样，就接在上一个报文后面；
+    // 只看总长是m_gso的倍数不行，一个2*m_gso的报文后面接上去，内核会把它切成两个
+    if (m_gso && m_pending > 0 && len <= m_gso) {
+        size_t last = m_pending - 1;
+        size_t cur = m_iovs[last].iov_len;
+        if (cur == (size_t)m_segments[last] * m_gso && cur + len <= m_bufSize && m_segments[last] < GSO_MAX_SEGMENTS
+                && m_msgs[last].msg_hdr.msg_namelen == addrlen
+                && memcmp(&m_addrs[last], addr, addrlen) == 0) {
+            memcpy(&m_bufs[last * m_bufSize + cur], data, len);
+            m_iovs[last].iov_len += len;
+            ++m_segments[last];
+            return true;
+        }
+    }
+    if (m_pending >= m_count) {
+        return false;
+    }
+    size_t i = m_pending++;
+    prepare(i, len);
+    memcpy(&m_bufs[i * m_bufSize], data, len);
+    memcpy(&m_addrs[i], addr, addrlen);
+    m_msgs[i].msg_hdr.msg_namelen = addrlen;
+    m_segments[i] = 1;
+    return true;
+}
+
+int UdpBatch::flush(int fd)
+{
+    for (size_t i = 0; i < m_pending; ++i) {
+        msghdr &hdr = m_msgs[i].msg_hdr;
+        if (m_gso && m_segments[i] > 1) {
+            hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsghdr *cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cm), &m_gso, sizeof m_gso);
+        } else {
+            hdr.msg_control = nullptr;
+            hdr.msg_controllen = 0;
+        }
+    }
+    size_t sent = 0;
+    while (sent < m_pending) {
+        int n = sendmmsg(fd, &m_msgs[sent], m_pending - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            m_pending = 0;
+            return -1;
+        }
+        sent += n;
+    }
+    m_pending = 0;
+    return sent;
+}
+
+bool UdpBatch::EnableGro(int fd)
+{
+    int on = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof on) == 0;
+}
+
+}
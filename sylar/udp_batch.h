@@ -0,0 +1,53 @@
+#ifndef __SYLAR_UDP_BATCH_H__
+#define __SYLAR_UDP_BATCH_H__
+
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+
+namespace sylar {
+
+// 一批UDP报文，一次recvmmsg/sendmmsg收发，mmsghdr/iovec/地址/buffer都是构造时分配好的，收发时不再分配内存
+// 走hook的recvmmsg/sendmmsg，在IOManager的协程里等待只挂起协程；一个对象只能同时被一个协程使用
+class UdpBatch {
+public:
+    typedef std::shared_ptr<UdpBatch> ptr;
+
+    // count: 一批最多几个报文；buf_size: 每个报文的buffer大小，开了GRO/GSO的话要64K才装得下合并后的报文
+    UdpBatch(size_t count = 64, size_t buf_size = 2048);
+
+    // 等到至少有一个报文，然后一次取走最多count个；返回收到的个数，出错或超时(SO_RCVTIMEO)返回-1
+    int recv(int fd);
+    const char *data(size_t i) const { return &m_bufs[i * m_bufSize]; }
+    size_t size(size_t i) const { return m_msgs[i].msg_len; }
+    const sockaddr_storage &addr(size_t i) const { return m_addrs[i]; }
+    // 开了GRO(EnableGro)时，内核可能把同一个流的多个报文合成一个交上来，这是合并前每段的大小，最后一段可以更短；0是没合并
+    uint16_t segmentSize(size_t i) const { return m_segments[i]; }
+
+    // 发：add先攒在buffer里，flush一次sendmmsg发出去；满了add返回false，要先flush
+    // 设了GSO段大小的话，发往同一个地址、不超过段大小的连续报文拼到同一个buffer里，由内核(或网卡)切成多个报文
+    bool add(const void *data, size_t len, const sockaddr *addr, socklen_t addrlen);
+    int flush(int fd);    // 全部发出去才返回(EAGAIN时挂起)，返回发出的报文数(按拼完以后的算)，出错返回-1，没发的丢掉
+    void setGso(uint16_t segment) { m_gso = segment; }
+    size_t pending() const { return m_pending; }
+
+    static bool EnableGro(int fd);
+private:
+    void prepare(size_t i, size_t len);
+private:
+    size_t m_count;
+    size_t m_bufSize;
+    std::vector<char> m_bufs;
+    std::vector<mmsghdr> m_msgs;
+    std::vector<iovec> m_iovs;
+    std::vector<sockaddr_storage> m_addrs;
+    std::vector<char> m_controls;
+    std::vector<uint16_t> m_segments;
+    size_t m_pending = 0;     // add了还没flush的mmsghdr数
+    uint16_t m_gso = 0;
+};
+
+}
+
+#endif
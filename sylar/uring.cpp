@@ -0,0 +1,190 @@
+#include "uring.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete
+        , unsigned flags, const void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+IOUring::ptr IOUring::Create(uint32_t entries)
+{
+    IOUring::ptr uring(new IOUring);
+    if (!uring->init(entries)) {
+        return nullptr;
+    }
+    return uring;
+}
+
+IOUring::IOUring()
+{
+}
+
+IOUring::~IOUring()
+{
+    if (m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool IOUring::init(uint32_t entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof p);
+    m_fd = sys_io_uring_setup(entries, &p);
+    if (m_fd < 0) {
+        SYLAR_LOG_INFO(g_logger) << "io_uring_setup(" << entries << ") errno="
+            << errno << " (" << strerror(errno) << ")";
+        return false;
+    }
+    // 等待要能带超时(EXT_ARG, 5.11)，完成队列溢出不能丢事件(NODROP)
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        SYLAR_LOG_INFO(g_logger) << "io_uring features=" << p.features << " not supported";
+        return false;
+    }
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            return false;
+        }
+    }
+    m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    m_sqes = (io_uring_sqe *)sqes;
+
+    char *sq = (char *)m_sqRing;
+    m_sqHead = (unsigned *)(sq + p.sq_off.head);
+    m_sqTail = (unsigned *)(sq + p.sq_off.tail);
+    m_sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    m_sqEntries = (unsigned *)(sq + p.sq_off.ring_entries);
+    m_sqArray = (unsigned *)(sq + p.sq_off.array);
+
+    char *cq = (char *)m_cqRing;
+    m_cqHead = (unsigned *)(cq + p.cq_off.head);
+    m_cqTail = (unsigned *)(cq + p.cq_off.tail);
+    m_cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+unsigned IOUring::unsubmitted()
+{
+    // 内核取走一个sqe就会把head往前推，所以tail - head就是还没提交的个数
+    return *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+}
+
+bool IOUring::push(const io_uring_sqe &sqe)
+{
+    MutexType::Lock lock(m_sqMutex);
+    if (unsubmitted() >= *m_sqEntries) {
+        sys_io_uring_enter(m_fd, unsubmitted(), 0, 0, nullptr, 0);
+        if (unsubmitted() >= *m_sqEntries) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring sq full fd=" << m_fd;
+            return false;
+        }
+    }
+    unsigned tail = *m_sqTail;
+    unsigned idx = tail & *m_sqMask;
+    m_sqes[idx] = sqe;
+    m_sqArray[idx] = idx;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int IOUring::submit()
+{
+    unsigned n = 0;
+    {
+        MutexType::Lock lock(m_sqMutex);
+        n = unsubmitted();
+    }
+    if (!n) {
+        return 0;
+    }
+    int rt = sys_io_uring_enter(m_fd, n, 0, 0, nullptr, 0);
+    if (rt < 0) {
+        SYLAR_LOG_ERROR(g_logger) << "io_uring_enter(" << m_fd << ", " << n << ") errno="
+            << errno << " (" << strerror(errno) << ")";
+    }
+    return rt;
+}
+
+int IOUring::wait(uint64_t timeout_us)
+{
+    unsigned n = 0;
+    {
+        MutexType::Lock lock(m_sqMutex);
+        n = unsubmitted();
+    }
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)&ts;
+    return sys_io_uring_enter(m_fd, n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG
+            , &arg, sizeof arg);
+}
+
+size_t IOUring::reap(std::vector<io_uring_cqe> &cqes)
+{
+    MutexType::Lock lock(m_cqMutex);
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != tail; ++i) {
+        cqes.push_back(m_cqes[i & *m_cqMask]);
+    }
+    __atomic_store_n(m_cqHead, tail, __ATOMIC_RELEASE);
+    return tail - head;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+#include <memory>
+#include <vector>
+#include <linux/io_uring.h>
+#include "thread.h"
+
+namespace sylar {
+
+// io_uring的简单封装，不依赖liburing，直接用系统调用 + mmap三块共享内存(提交队列、完成队列、sqe数组)
+// 提交队列(SQ)和完成队列(CQ)分别用一把锁保护，多个线程可以同时往里面塞sqe、同时等待完成
+class IOUring {
+public:
+    typedef std::shared_ptr<IOUring> ptr;
+    typedef Mutex MutexType;
+
+    // 内核不支持(或者缺少我们需要的特性)时返回nullptr，调用方退回epoll
+    static IOUring::ptr Create(uint32_t entries);
+    ~IOUring();
+
+    // 往提交队列里放一个sqe，只是放进去并不提交，队列满了会先提交一次再放
+    bool push(const io_uring_sqe &sqe);
+    // 把攒下来的sqe一次性提交给内核，返回提交的个数
+    int submit();
+    // 提交攒下来的sqe，并等待至少一个完成事件，最多等timeout_us微秒
+    int wait(uint64_t timeout_us);
+    // 把完成队列里的事件全部取出来
+    size_t reap(std::vector<io_uring_cqe> &cqes);
+
+    int getFd() const { return m_fd; }
+private:
+    IOUring();
+    IOUring(const IOUring &) = delete;
+    IOUring &operator=(const IOUring &) = delete;
+
+    bool init(uint32_t entries);
+    unsigned unsubmitted();    // 放进了提交队列但内核还没取走的sqe个数
+private:
+    int m_fd = -1;
+
+    void *m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void *m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    unsigned *m_sqHead = nullptr;
+    unsigned *m_sqTail = nullptr;
+    unsigned *m_sqMask = nullptr;
+    unsigned *m_sqEntries = nullptr;
+    unsigned *m_sqArray = nullptr;
+
+    unsigned *m_cqHead = nullptr;
+    unsigned *m_cqTail = nullptr;
+    unsigned *m_cqMask = nullptr;
+    io_uring_cqe *m_cqes = nullptr;
+
+    MutexType m_sqMutex;
+    MutexType m_cqMutex;
+};
+
+}
+
+#endif
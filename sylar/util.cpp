@@ -1,6 +1,7 @@
 #include "util.h"
 #include <execinfo.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "log.h"
 #include "fiber.h"
@@ -62,7 +63,19 @@ uint64_t GetCurrentUS()
 {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec / 1000;
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
 
-}
\ No newline at end of file
+uint64_t GetMonotonicMS()
+{
+    return GetMonotonicUS() / 1000;
+}
+
+uint64_t GetMonotonicUS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
+}
@@ -21,6 +21,9 @@ std::string BacktraceToString(int size = 64, int skip = 2, const std::string &pr
 // 时间ms
 uint64_t GetCurrentMS();
 uint64_t GetCurrentUS();
+// 单调时钟(CLOCK_MONOTONIC)，不受修改系统时间影响，算超时、定时器用这个；起点不固定，只能用来算时间差
+uint64_t GetMonotonicMS();
+uint64_t GetMonotonicUS();
 
 }
 
@@ -0,0 +1,69 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/acceptor.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 几个客户端线程不停地连，看连接在各个监听socket(线程)之间分得匀不匀，以及总的accept速度
+void bench_accept(bool reuseport, bool per_thread_epoll, int clients, int conns)
+{
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(per_thread_epoll);
+    sylar::IOManager iom(4, false, "accept");
+    std::atomic<int> accepted = {0};
+    sylar::Acceptor acceptor(&iom, [&accepted](int fd) {
+        ++accepted;
+        close(fd);
+    });
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (!acceptor.bind((sockaddr *)&addr, sizeof addr, reuseport)) {
+        return;
+    }
+    socklen_t len = sizeof addr;
+    getsockname(acceptor.getSockets()[0], (sockaddr *)&addr, &len);
+    acceptor.start();
+
+    uint64_t start = sylar::GetCurrentMS();
+    std::vector<sylar::Thread::ptr> thrs;
+    for (int i = 0; i < clients; ++i) {
+        thrs.push_back(std::make_shared<sylar::Thread>([addr, conns]() {
+            for (int j = 0; j < conns; ++j) {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                connect(fd, (const sockaddr *)&addr, sizeof addr);
+                close(fd);
+            }
+        }, "client_" + std::to_string(i)));
+    }
+    for (auto &i : thrs) {
+        i->join();
+    }
+    for (int i = 0; i < 300 && accepted < clients * conns; ++i) {
+        usleep(10 * 1000);
+    }
+    uint64_t used = sylar::GetCurrentMS() - start;
+    acceptor.stop();
+    iom.stop();
+
+    std::stringstream ss;
+    for (size_t i = 0; i < acceptor.getSockets().size(); ++i) {
+        ss << " " << acceptor.getAccepted(i);
+    }
+    SYLAR_LOG_INFO(g_logger) << "reuseport=" << reuseport << " per_thread_epoll=" << per_thread_epoll
+        << " sockets=" << acceptor.getSockets().size() << " accepted=" << accepted
+        << " used=" << used << "ms per_socket:" << ss.str();
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(false);
+}
+
+int main(int argc, char **argv)
+{
+    bench_accept(false, false, 4, 5000);
+    bench_accept(false, true, 4, 5000);
+    bench_accept(true, true, 4, 5000);
+    return 0;
+}
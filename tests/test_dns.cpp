@@ -0,0 +1,206 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/dns.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fstream>
+#include <map>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 本地的假DNS：a.test有A记录(ttl 1s)，slow.test 100ms后才回，drop.test不回，
+// short.svc.test给search用，spoof.test先回两个问题不对的假包，再回大写名字的真包，其他的都是NXDOMAIN(SOA minimum 2s)
+static std::map<std::string, int> s_queries;
+
+static std::string decode_name(const uint8_t *buf, size_t len, size_t &pos)
+{
+    std::string name;
+    while (pos < len && buf[pos]) {
+        if (!name.empty()) {
+            name += ".";
+        }
+        name.append((const char *)buf + pos + 1, buf[pos]);
+        pos += buf[pos] + 1;
+    }
+    ++pos;
+    return name;
+}
+
+static void stub_reply(int sock, std::string req, sockaddr_in peer)
+{
+    size_t pos = 12;
+    std::string name = decode_name((const uint8_t *)req.data(), req.size(), pos);
+    int qtype = ((uint8_t)req[pos] << 8) | (uint8_t)req[pos + 1];
+    ++s_queries[name];
+    if (name == "drop.test") {
+        return;
+    }
+    if (name == "slow.test") {
+        usleep(100 * 1000);
+    }
+
+    std::string ip;
+    uint32_t ttl = 60;
+    if (name == "a.test") {
+        ip = "10.0.0.1";
+        ttl = 1;
+    } else if (name == "slow.test") {
+        ip = "10.0.0.2";
+    } else if (name == "short.svc.test") {
+        ip = "10.0.0.3";
+    } else if (name == "spoof.test") {
+        ip = "10.0.0.4";
+    }
+    bool nx = ip.empty() && name != "a.test";
+
+    std::string resp = req.substr(0, pos + 4);
+    resp[2] = (char)0x81;
+    resp[3] = (char)(0x80 | (nx ? 3 : 0));
+    resp[6] = 0;
+    resp[7] = (!ip.empty() && qtype == 1) ? 1 : 0;
+    resp[8] = 0;
+    resp[9] = nx ? 1 : 0;
+    resp[10] = resp[11] = 0;
+    if (resp[7]) {
+        resp.append("\xc0\x0c\x00\x01\x00\x01", 6);
+        resp.push_back(ttl >> 24);
+        resp.push_back(ttl >> 16);
+        resp.push_back(ttl >> 8);
+        resp.push_back(ttl);
+        resp.append("\x00\x04", 2);
+        in_addr a;
+        inet_pton(AF_INET, ip.c_str(), &a);
+        resp.append((const char *)&a, 4);
+    } else if (nx) {
+        // SOA: mname/rname都是根，serial refresh retry expire minimum
+        resp.append("\x00\x00\x06\x00\x01\x00\x00\x00\x3c\x00\x16\x00\x00", 13);
+        resp.append("\x00\x00\x00\x01\x00\x00\x00\x01\x00\x00\x00\x01\x00\x00\x00\x01\x00\x00\x00\x02", 20);
+    }
+    if (name == "spoof.test" && resp[7]) {
+        // id对、类型对，但名字不一样；名字一样但class不是IN；都不能被接受
+        std::string fake = resp;
+        fake.replace(13, 5, "proof");
+        fake.replace(fake.size() - 4, 4, "\x06\x06\x06\x06", 4);
+        sendto(sock, fake.data(), fake.size(), 0, (sockaddr *)&peer, sizeof peer);
+        fake = resp;
+        fake[pos + 3] = 3;
+        fake.replace(fake.size() - 4, 4, "\x06\x06\x06\x06", 4);
+        sendto(sock, fake.data(), fake.size(), 0, (sockaddr *)&peer, sizeof peer);
+        resp.replace(13, 5, "SPOOF");
+    }
+    sendto(sock, resp.data(), resp.size(), 0, (sockaddr *)&peer, sizeof peer);
+}
+
+static int start_stub(sylar::IOManager *iom, sockaddr_in &addr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (sockaddr *)&addr, sizeof addr);
+    socklen_t len = sizeof addr;
+    getsockname(sock, (sockaddr *)&addr, &len);
+    iom->schedule([iom, sock]() {
+        while (true) {
+            char buf[512];
+            sockaddr_in peer;
+            socklen_t plen = sizeof peer;
+            ssize_t n = recvfrom(sock, buf, sizeof buf, 0, (sockaddr *)&peer, &plen);
+            if (n <= 0) {
+                break;
+            }
+            iom->schedule(std::bind(stub_reply, sock, std::string(buf, n), peer));
+        }
+    });
+    return sock;
+}
+
+static std::string to_string(const std::vector<sockaddr_storage> &addrs)
+{
+    std::string s;
+    for (auto &a : addrs) {
+        char buf[INET6_ADDRSTRLEN] = {0};
+        if (a.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((sockaddr_in *)&a)->sin_addr, buf, sizeof buf);
+        } else {
+            inet_ntop(AF_INET6, &((sockaddr_in6 *)&a)->sin6_addr, buf, sizeof buf);
+        }
+        s += s.empty() ? buf : std::string(",") + buf;
+    }
+    return s;
+}
+
+static std::string check(sylar::DnsResolver &r, const std::string &host, int family = AF_INET)
+{
+    std::vector<sockaddr_storage> addrs;
+    uint64_t start = sylar::GetCurrentMS();
+    auto st = r.resolve(host, addrs, family);
+    auto stats = r.getStats();
+    SYLAR_LOG_INFO(g_logger) << "resolve " << host << " status=" << st << " addrs=" << to_string(addrs)
+        << " used=" << sylar::GetCurrentMS() - start << "ms queries=" << stats.queries
+        << " hits=" << stats.cacheHits << " negative=" << stats.negativeHits
+        << " coalesced=" << stats.coalesced << " timeouts=" << stats.timeouts;
+    return to_string(addrs);
+}
+
+void test_dns()
+{
+    {
+        std::ofstream conf("/tmp/sylar_test_resolv.conf");
+        conf << "search svc.test\noptions ndots:1 timeout:1 attempts:1\n";
+        std::ofstream hosts("/tmp/sylar_test_hosts");
+        hosts << "10.9.9.9 myhost.test myhost\n";
+    }
+    sylar::IOManager iom(2, false);
+    iom.schedule([&iom]() {
+        sockaddr_in addr;
+        int stub = start_stub(&iom, addr);
+        sylar::DnsResolver r;
+        r.loadResolvConf("/tmp/sylar_test_resolv.conf");
+        r.loadHosts("/tmp/sylar_test_hosts");
+        sockaddr_storage server;
+        memcpy(&server, &addr, sizeof addr);
+        r.setServers({server});
+
+        check(r, "MyHost.test");
+        check(r, "127.0.0.1");
+        check(r, "a.test");
+        check(r, "a.test");       // 缓存
+        check(r, "a.test", AF_UNSPEC);    // A走缓存，AAAA查不到
+
+        // 10个协程同时查，只发一个请求
+        std::atomic<int> done = {0};
+        for (int i = 0; i < 10; ++i) {
+            iom.schedule([&r, &done]() {
+                std::vector<sockaddr_storage> addrs;
+                r.resolve("slow.test", addrs);
+                ++done;
+            });
+        }
+        while (done < 10) {
+            usleep(10 * 1000);
+        }
+        check(r, "slow.test");
+        SYLAR_LOG_INFO(g_logger) << "slow.test stub queries=" << s_queries["slow.test"];
+
+        check(r, "nx.test");
+        check(r, "nx.test");      // 否定缓存
+        check(r, "short");        // search展开成short.svc.test
+        check(r, "drop.test");    // 超时
+        std::string spoofed = check(r, "spoof.test");    // 假包都被丢掉，拿到的是真包的地址
+        SYLAR_ASSERT(spoofed == "10.0.0.4");
+
+        sleep(2);                 // a.test的ttl和nx.test的否定缓存都过期了
+        check(r, "a.test");
+        check(r, "nx.test");
+        SYLAR_LOG_INFO(g_logger) << "stub queries a.test=" << s_queries["a.test"] << " nx.test=" << s_queries["nx.test"]
+            << " nx.test.svc.test=" << s_queries["nx.test.svc.test"] << " short=" << s_queries["short.svc.test"];
+        close(stub);
+    });
+}
+
+int main(int argc, char **argv)
+{
+    test_dns();
+    return 0;
+}
@@ -1,6 +1,17 @@
 #include "sylar/hook.h"
 #include "sylar/log.h"
 #include "sylar/iomanager.h"
+#include "sylar/util.h"
+#include "sylar/config.h"
+#include "sylar/file_io.h"
+#include "sylar/macro.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -18,9 +29,262 @@ void test_sleep() {
     SYLAR_LOG_INFO(g_logger) << "test_sleep";
 }
 
+static int listen_local(sockaddr_in &addr)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (sockaddr *)&addr, sizeof addr);
+    listen(sock, 4096);
+    socklen_t len = sizeof addr;
+    getsockname(sock, (sockaddr *)&addr, &len);
+    return sock;
+}
+
+// 设了SO_RCVTIMEO的阻塞recv，对端一直不发，到时间返回EAGAIN
+void test_sock_timeout() {
+    sylar::IOManager iom(1);
+    iom.schedule([](){
+        sockaddr_in addr;
+        int lsock = listen_local(addr);
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int rt = connect(sock, (const sockaddr *)&addr, sizeof addr);
+        timeval tv = {0, 200 * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        // 长度不对的直接交给系统调用报错，不能读越界，也不改已经设好的超时
+        int small = 0;
+        SYLAR_ASSERT(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &small, sizeof small) == -1 && errno == EINVAL);
+        uint64_t start = sylar::GetCurrentMS();
+        char buf[16];
+        ssize_t n = recv(sock, buf, sizeof buf, 0);
+        SYLAR_LOG_INFO(g_logger) << "connect rt=" << rt << " recv n=" << n << " errno=" << errno
+            << " (" << strerror(errno) << ") used=" << sylar::GetCurrentMS() - start << "ms";
+        close(sock);
+        close(lsock);
+    });
+}
+
+// 一个线程里上千个连接，客户端和服务端都按阻塞的写法来写
+void test_many_conns() {
+    static const int CONNS = 2000;
+    sylar::IOManager iom(1);
+    sockaddr_in addr;
+    int lsock = listen_local(addr);
+    uint64_t start = sylar::GetCurrentMS();
+    static std::atomic<int> s_echoed = {0};
+    iom.schedule([lsock](){
+        for (int i = 0; i < CONNS; ++i) {
+            int fd = accept(lsock, nullptr, nullptr);
+            if (fd < 0) {
+                SYLAR_LOG_ERROR(g_logger) << "accept errno=" << errno;
+                break;
+            }
+            sylar::IOManager::GetThis()->schedule([fd](){
+                char buf[64];
+                ssize_t n = 0;
+                while ((n = recv(fd, buf, sizeof buf, 0)) > 0) {
+                    send(fd, buf, n, 0);
+                }
+                close(fd);
+            });
+        }
+        close(lsock);
+    });
+    for (int i = 0; i < CONNS; ++i) {
+        iom.schedule([addr](){
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(sock, (const sockaddr *)&addr, sizeof addr)) {
+                SYLAR_LOG_ERROR(g_logger) << "connect errno=" << errno;
+                close(sock);
+                return;
+            }
+            char buf[8] = {0};
+            sleep(1);    // 所有连接都同时挂着
+            send(sock, "ping", 4, 0);
+            if (recv(sock, buf, sizeof buf, 0) == 4) {
+                ++s_echoed;
+            }
+            close(sock);
+        });
+    }
+    iom.stop();
+    SYLAR_LOG_INFO(g_logger) << "conns=" << CONNS << " echoed=" << s_echoed
+        << " used=" << sylar::GetCurrentMS() - start << "ms";
+}
+
+// 单线程里一个协程poll/select/epoll_wait等，另一个协程100ms后写；没hook的话线程被堵住，只能等到超时
+void test_poll() {
+    sylar::IOManager iom(1);
+    int fds[2];
+    pipe(fds);
+    int epfd = epoll_create1(0);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[0];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev);
+    iom.schedule([fds, epfd](){
+        uint64_t start = sylar::GetCurrentMS();
+        pollfd pfd = {fds[0], POLLIN, 0};
+        int rt = poll(&pfd, 1, 1000);
+        SYLAR_LOG_INFO(g_logger) << "poll rt=" << rt << " revents=" << pfd.revents
+            << " used=" << sylar::GetCurrentMS() - start << "ms";
+        char c;
+        read(fds[0], &c, 1);
+
+        start = sylar::GetCurrentMS();
+        fd_set rset;
+        FD_ZERO(&rset);
+        FD_SET(fds[0], &rset);
+        timeval tv = {1, 0};
+        rt = select(fds[0] + 1, &rset, nullptr, nullptr, &tv);
+        SYLAR_LOG_INFO(g_logger) << "select rt=" << rt << " isset=" << FD_ISSET(fds[0], &rset)
+            << " used=" << sylar::GetCurrentMS() - start << "ms";
+        read(fds[0], &c, 1);
+
+        start = sylar::GetCurrentMS();
+        epoll_event evs[4];
+        rt = epoll_wait(epfd, evs, 4, 1000);
+        SYLAR_LOG_INFO(g_logger) << "epoll_wait rt=" << rt
+            << " used=" << sylar::GetCurrentMS() - start << "ms";
+
+        // 没数据，按时超时；pipe的写端一直可写，部分就绪只报可写的那个
+        read(fds[0], &c, 1);
+        start = sylar::GetCurrentMS();
+        pollfd pfds[2] = {{fds[0], POLLIN, 0}, {fds[1], POLLOUT, 0}};
+        rt = poll(pfds, 1, 150);
+        SYLAR_LOG_INFO(g_logger) << "poll timeout rt=" << rt << " used=" << sylar::GetCurrentMS() - start << "ms";
+        rt = poll(pfds, 2, 150);
+        SYLAR_LOG_INFO(g_logger) << "poll partial rt=" << rt << " revents=" << pfds[0].revents << "," << pfds[1].revents;
+    });
+    iom.schedule([fds](){
+        for (int i = 0; i < 3; ++i) {
+            usleep(100 * 1000);
+            write(fds[1], "x", 1);
+        }
+    });
+    iom.stop();
+    close(epfd);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// 一个协程已经在等fd可读，另一个协程再poll同一个fd：注册不上，隔一会儿重新poll，按时超时，不能断言，
+// 也不能把线程堵住，同一个线程上的第三个协程照常每10ms醒一次
+void test_poll_busy() {
+    sylar::IOManager iom(1, false);
+    int fds[2];
+    pipe(fds);
+    std::atomic<uint64_t> max_gap = {0};
+    iom.schedule([&iom, fds](){
+        iom.addEvent(fds[0], sylar::IOManager::READ);
+        sylar::Fiber::YieldToHold();
+        char c;
+        read(fds[0], &c, 1);
+        SYLAR_LOG_INFO(g_logger) << "first waiter woken";
+    });
+    iom.schedule([fds](){
+        uint64_t start = sylar::GetCurrentMS();
+        pollfd pfd = {fds[0], POLLIN, 0};
+        int rt = poll(&pfd, 1, 100);
+        SYLAR_LOG_INFO(g_logger) << "poll busy fd rt=" << rt << " used=" << sylar::GetCurrentMS() - start << "ms";
+        SYLAR_ASSERT(rt == 0);
+        write(fds[1], "x", 1);
+    });
+    iom.schedule([&max_gap](){
+        uint64_t last = sylar::GetCurrentMS();
+        for (int i = 0; i < 8; ++i) {
+            usleep(10 * 1000);
+            uint64_t now = sylar::GetCurrentMS();
+            max_gap = std::max<uint64_t>(max_gap, now - last);
+            last = now;
+        }
+    });
+    iom.stop();
+    SYLAR_LOG_INFO(g_logger) << "poll busy ticker max_gap=" << max_gap << "ms";
+    SYLAR_ASSERT(max_gap < 50);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// 单线程里两个协程各睡200ms，一共也只要200ms
+void test_nanosleep() {
+    uint64_t start = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(1);
+        iom.schedule([](){
+            timespec ts = {0, 200 * 1000 * 1000};
+            nanosleep(&ts, nullptr);
+        });
+        iom.schedule([](){
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += 200 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "nanosleep x2 used=" << sylar::GetCurrentMS() - start << "ms";
+}
+
+// 单线程里一个协程写32MB文件再fsync，另一个协程每5ms醒一次，记下最大的间隔；
+// 文件读写offload到线程池的话，定时的协程不会被磁盘卡住
+void test_file_io(bool offload) {
+    sylar::Config::Lookup<bool>("fileio.offload", true, "")->setValue(offload);
+    std::shared_ptr<bool> done(new bool(false));
+    std::shared_ptr<uint64_t> max_gap(new uint64_t(0));
+    {
+        sylar::IOManager iom(1);
+        iom.schedule([done, max_gap](){
+            uint64_t last = sylar::GetCurrentMS();
+            while (!*done) {
+                usleep(5 * 1000);
+                uint64_t now = sylar::GetCurrentMS();
+                *max_gap = std::max(*max_gap, now - last);
+                last = now;
+            }
+        });
+        iom.schedule([done](){
+            usleep(20 * 1000);    // 等定时的协程先跑起来
+            const char *path = "/tmp/sylar_test_file_io";
+            int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+            std::string block(1024 * 1024, 'a');
+            uint64_t start = sylar::GetCurrentMS();
+            for (int i = 0; i < 32; ++i) {
+                block[0] = 'a' + i % 26;
+                write(fd, block.data(), block.size());
+            }
+            int rt = fsync(fd);
+            char c = 0;
+            ssize_t n = pread(fd, &c, 1, 5 * 1024 * 1024);
+            SYLAR_LOG_INFO(g_logger) << "file_io write+fsync rt=" << rt
+                << " used=" << sylar::GetCurrentMS() - start << "ms pread n=" << n << " c=" << c;
+            close(fd);
+            unlink(path);
+            *done = true;
+        });
+    }
+    auto stats = sylar::FileIOMgr::GetInstance()->getStats();
+    SYLAR_LOG_INFO(g_logger) << "file_io offload=" << offload << " ticker max_gap=" << *max_gap << "ms"
+        << " submitted=" << stats.submitted << " completed=" << stats.completed << " nowait=" << stats.nowait
+        << " max_queued=" << stats.maxQueued << " wait_us=" << stats.waitUs << " run_us=" << stats.runUs
+        << " latency=" << stats.latency[0] << "," << stats.latency[1] << "," << stats.latency[2] << ","
+        << stats.latency[3] << "," << stats.latency[4] << "," << stats.latency[5] << "," << stats.latency[6];
+}
+
 int main()
 {
     test_sleep();
+    test_sock_timeout();
+    test_many_conns();
+    test_poll();
+    test_poll_busy();
+    test_nanosleep();
+    test_file_io(false);
+    test_file_io(true);
 
     return 0;
 }
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include "sylar/sylar.h"
 #include "sylar/iomanager.h"
+#include "sylar/fd_manager.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <fcntl.h>
 
 static sylar::Logger::ptr g_logger_root = SYLAR_LOG_ROOT();
 
@@ -30,8 +32,333 @@ void test_timer()
     }, true);
 }
 
+// io_uring后端: socketpair一端直接异步读，另一端addEvent等可写再写
+void test_uring()
+{
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("io_uring");
+    sylar::IOManager iom(2, false, "uring");
+    SYLAR_LOG_INFO(g_logger_root) << "is_uring=" << iom.isUring();
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    iom.schedule([fds]() {
+        char buf[64] = {0};
+        ssize_t n = sylar::IOManager::GetThis()->asyncRead(fds[0], buf, sizeof buf - 1);
+        SYLAR_LOG_INFO(g_logger_root) << "asyncRead n=" << n << " buf=" << buf;
+    });
+    iom.schedule([fds]() {
+        sylar::IOManager::GetThis()->addEvent(fds[1], sylar::IOManager::WRITE);
+        sylar::Fiber::YieldToHold();
+        ssize_t n = sylar::IOManager::GetThis()->asyncWrite(fds[1], "hello uring", 11);
+        SYLAR_LOG_INFO(g_logger_root) << "asyncWrite n=" << n;
+    });
+    iom.stop();
+    close(fds[0]);
+    close(fds[1]);
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("epoll");
+}
+
+// 每个线程一个epoll：在哪个线程注册的事件，就在哪个线程上触发；每个线程固定调度两个协程，每个Reactor都要处理到事件
+void test_per_thread_epoll()
+{
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(true);
+    sylar::Mutex mutex;
+    std::map<int, int> handled;    // 触发事件的线程 -> 次数
+    std::atomic<int> mismatch = {0};
+    std::vector<int> tids;
+    std::vector<int> opened;
+    {
+        sylar::IOManager iom(3, false, "reactor");
+        tids = iom.getThreadIds();
+        for (int i = 0; i < 6; ++i) {
+            iom.schedule([&]() {
+                int fds[2];
+                socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+                int tid = sylar::GetThreadId();
+                sylar::IOManager::GetThis()->addEvent(fds[0], sylar::IOManager::READ, [&, tid, fds]() {
+                    SYLAR_LOG_INFO(g_logger_root) << "fd=" << fds[0] << " add_thread=" << tid
+                        << " trigger_thread=" << sylar::GetThreadId();
+                    if (tid != sylar::GetThreadId()) {
+                        ++mismatch;
+                    }
+                    sylar::Mutex::Lock lock(mutex);
+                    ++handled[sylar::GetThreadId()];
+                });
+                write(fds[1], "x", 1);
+                sylar::Mutex::Lock lock(mutex);
+                opened.push_back(fds[0]);
+                opened.push_back(fds[1]);
+            }, tids[i % tids.size()]);
+        }
+        iom.stop();
+    }
+    for (int fd : opened) {    // 最后再关，fd号不复用，复用的号会沿用第一次注册时的Reactor
+        close(fd);
+    }
+    SYLAR_ASSERT(mismatch == 0);
+    for (int tid : tids) {
+        SYLAR_LOG_INFO(g_logger_root) << "reactor thread=" << tid << " handled=" << handled[tid];
+        SYLAR_ASSERT(handled[tid] > 0);
+    }
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(false);
+}
+
+// busy poll模式：一个线程空转，看一下空转的代价
+void test_busy_poll()
+{
+    sylar::Config::Lookup<uint32_t>("iomanager.busy_poll_threads")->setValue(1);
+    sylar::IOManager iom(2, false, "busy");
+    iom.schedule([]() {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        for (int i = 0; i < 10; ++i) {
+            sylar::IOManager::GetThis()->addEvent(fds[0], sylar::IOManager::READ);
+            write(fds[1], "x", 1);
+            sylar::Fiber::YieldToHold();
+            char c;
+            read(fds[0], &c, 1);
+        }
+        close(fds[0]);
+        close(fds[1]);
+    });
+    iom.stop();
+    sylar::IOManager::PollStats stats = iom.getPollStats();
+    SYLAR_LOG_INFO(g_logger_root) << "busy poll loops=" << stats.loops << " empty=" << stats.emptyPolls
+        << " events=" << stats.events << " batch1=" << stats.batch[0];
+    sylar::Config::Lookup<uint32_t>("iomanager.busy_poll_threads")->setValue(0);
+}
+
+// 并发注册/取消/删除/触发同一批fd：每次注册成功，回调要么恰好执行一次，要么被delEvent删掉
+void test_event_stress(const std::string &backend, const std::string &mode = "edge")
+{
+    static const int PAIRS = 8;
+    static const int ROUNDS = 20000;
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue(backend);
+    sylar::Config::Lookup<std::string>("iomanager.event_mode")->setValue(mode);
+    std::atomic<int> added = {0};
+    std::atomic<int> fired = {0};
+    std::atomic<int> deleted = {0};
+    std::atomic<int> running = {3};
+    std::atomic<bool> pending[PAIRS][2];
+    int fds[PAIRS][2];
+    for (int i = 0; i < PAIRS; ++i) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+        fcntl(fds[i][0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[i][1], F_SETFL, O_NONBLOCK);
+        pending[i][0] = pending[i][1] = false;
+    }
+    {
+        sylar::IOManager iom(4, false, "stress");
+        // 注册的协程：自己注册的事件回调了(或者删掉了)才重新注册
+        iom.schedule([&]() {
+            sylar::IOManager *iom = sylar::IOManager::GetThis();
+            for (int r = 0; r < ROUNDS; ++r) {
+                int i = r % PAIRS;
+                int j = (r / PAIRS) % 2;
+                int fd = fds[i][0];
+                sylar::IOManager::Event event = j ? sylar::IOManager::WRITE : sylar::IOManager::READ;
+                if (!pending[i][j]) {
+                    pending[i][j] = true;
+                    int rt = iom->addEvent(fd, event, [&, i, j, fd]() {
+                        char buf[64];
+                        while (read(fd, buf, sizeof buf) > 0);
+                        ++fired;
+                        pending[i][j] = false;
+                    });
+                    if (rt) {
+                        pending[i][j] = false;
+                    } else {
+                        ++added;
+                    }
+                } else if (r % 7 == 0 && iom->delEvent(fd, event)) {
+                    ++deleted;
+                    pending[i][j] = false;
+                }
+                if (r % 64 == 0) {
+                    sylar::Fiber::YieldToReady();
+                }
+            }
+            if (--running == 0) {    // 最后一个结束的把还在等的事件都取消掉，不然stop会一直等
+                for (int i = 0; i < PAIRS; ++i) {
+                    iom->cancleAllEvent(fds[i][0]);
+                }
+            }
+        });
+        // 取消和触发的协程
+        for (int t = 0; t < 2; ++t) {
+            iom.schedule([&, t]() {
+                sylar::IOManager *iom = sylar::IOManager::GetThis();
+                for (int r = 0; r < ROUNDS; ++r) {
+                    int i = (r + t) % PAIRS;
+                    if ((r + t) % 3 == 0) {
+                        iom->cancleEvent(fds[i][0], sylar::IOManager::READ);
+                    } else if ((r + t) % 5 == 0) {
+                        iom->cancleAllEvent(fds[i][0]);
+                    } else {
+                        write(fds[i][1], "x", 1);
+                    }
+                    if (r % 64 == 0) {
+                        sylar::Fiber::YieldToReady();
+                    }
+                }
+                if (--running == 0) {
+                    for (int i = 0; i < PAIRS; ++i) {
+                        iom->cancleAllEvent(fds[i][0]);
+                    }
+                }
+            });
+        }
+        iom.stop();
+    }
+    SYLAR_LOG_INFO(g_logger_root) << "event stress backend=" << backend << " mode=" << mode << " added=" << added
+        << " fired=" << fired << " deleted=" << deleted;
+    SYLAR_ASSERT(added == fired + deleted);
+    for (int i = 0; i < PAIRS; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("epoll");
+    sylar::Config::Lookup<std::string>("iomanager.event_mode")->setValue("edge");
+}
+
+// 两个协程通过socketpair一来一回，看每个来回要几次epoll_ctl
+void test_event_mode(sylar::IOManager::EventMode mode)
+{
+    static const int ROUNDS = 10000;
+    sylar::IOManager iom(2, false, "echo");
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    iom.setEventMode(fds[0], mode);
+    iom.setEventMode(fds[1], mode);
+    auto wait_read = [](int fd) {
+        char c;
+        while (read(fd, &c, 1) != 1) {
+            sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ);
+            sylar::Fiber::YieldToHold();
+        }
+    };
+    uint64_t start = sylar::GetCurrentMS();
+    iom.schedule([fds, wait_read]() {
+        for (int i = 0; i < ROUNDS; ++i) {
+            write(fds[0], "x", 1);
+            wait_read(fds[0]);
+        }
+    });
+    iom.schedule([fds, wait_read]() {
+        for (int i = 0; i < ROUNDS; ++i) {
+            wait_read(fds[1]);
+            write(fds[1], "x", 1);
+        }
+    });
+    iom.stop();
+    sylar::IOManager::PollStats stats = iom.getPollStats();
+    SYLAR_LOG_INFO(g_logger_root) << "event mode=" << mode << " rounds=" << ROUNDS
+        << " epoll_ctl=" << stats.ctls << " per_round=" << (double)stats.ctls / ROUNDS
+        << " used=" << sylar::GetCurrentMS() - start << "ms";
+    iom.cancleAllEvent(fds[0]);
+    iom.cancleAllEvent(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// PERSIST模式下pipe关了以后fd号被复用，新的fd要能重新加进epoll
+void test_persist_reuse()
+{
+    sylar::Config::Lookup<std::string>("iomanager.event_mode")->setValue("persist");
+    std::atomic<int> timeouts = {0};
+    {
+        sylar::IOManager iom(1, false, "reuse");
+        iom.schedule([&iom, &timeouts]() {
+            for (int i = 0; i < 3; ++i) {
+                int fds[2];
+                pipe(fds);
+                iom.addEvent(fds[0], sylar::IOManager::READ);
+                auto timer = iom.addTimer(1000, [&iom, &timeouts, fds]() {
+                    ++timeouts;
+                    iom.cancleEvent(fds[0], sylar::IOManager::READ);
+                });
+                write(fds[1], "x", 1);
+                sylar::Fiber::YieldToHold();
+                timer->cancle();
+                SYLAR_LOG_INFO(g_logger_root) << "persist reuse round=" << i << " fd=" << fds[0];
+                close(fds[0]);
+                close(fds[1]);
+            }
+        });
+    }
+    sylar::Config::Lookup<std::string>("iomanager.event_mode")->setValue("edge");
+    SYLAR_ASSERT(timeouts == 0);
+}
+
+static std::string hist_str(const sylar::IOManager::LoopHistogram &h)
+{
+    std::stringstream ss;
+    ss << "n=" << h.count << " p50=" << h.percentile(0.5) << " p99=" << h.percentile(0.99) << " max=" << h.max;
+    return ss.str();
+}
+
+// 事件循环统计：两个协程用socketpair来回传一个字节，加上一批定时器，对比开关统计的耗时
+void test_loop_stats(bool enable, int rounds)
+{
+    sylar::Config::Lookup<bool>("iomanager.loop_stats")->setValue(enable);
+    uint64_t start = sylar::GetCurrentUS();
+    sylar::IOManager iom(2, false, "stats");
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    for (int fd : fds) {    // socketpair没有hook，手动登记成socket，读写才会挂起协程；前面的测试没走hook关掉的fd要先清掉
+        sylar::FdMgr::GetInstance()->del(fd);
+        sylar::FdMgr::GetInstance()->get(fd, true);
+    }
+    for (int side = 0; side < 2; ++side) {
+        iom.schedule([fds, side, rounds]() {
+            char c = 'x';
+            if (side == 0) {
+                write(fds[0], &c, 1);
+            }
+            for (int i = 0; i < rounds; ++i) {
+                read(fds[side], &c, 1);
+                if (side == 1 || i + 1 < rounds) {
+                    write(fds[side], &c, 1);
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 100; ++i) {
+        iom.addTimer(1 + i % 10, []() {});
+    }
+    iom.stop();
+    close(fds[0]);
+    close(fds[1]);
+    uint64_t used = sylar::GetCurrentUS() - start;
+    sylar::IOManager::LoopSnapshot snapshot = iom.getLoopStats();
+    SYLAR_LOG_INFO(g_logger_root) << "loop stats enable=" << enable << " rounds=" << rounds << " used=" << used / 1000
+        << "ms threads=" << snapshot.threads.size() << " pending=" << snapshot.pendingEvents
+        << " tickles=" << snapshot.tickles << " tickle_writes=" << snapshot.tickleWrites;
+    for (auto &t : snapshot.threads) {
+        SYLAR_LOG_INFO(g_logger_root) << "  thread=" << t.threadId << " loops=" << t.loops << " tickle_wakeups=" << t.tickleWakeups
+            << "\n    wait_us " << hist_str(t.waitUs) << "\n    events " << hist_str(t.events)
+            << "\n    timer_lag_us " << hist_str(t.timerLagUs) << "\n    run_us " << hist_str(t.runUs);
+    }
+    sylar::Config::Lookup<bool>("iomanager.loop_stats")->setValue(false);
+}
+
 int main(int argc, char **argv)
 {
+    test_event_mode(sylar::IOManager::EDGE);
+    test_event_mode(sylar::IOManager::ONESHOT);
+    test_event_mode(sylar::IOManager::PERSIST);
+    test_persist_reuse();
+    test_event_stress("epoll");
+    test_event_stress("epoll", "oneshot");
+    test_event_stress("epoll", "persist");
+    test_event_stress("io_uring");
+    test_busy_poll();
+    test_per_thread_epoll();
+    test_uring();
+    test_loop_stats(false, 20000);
+    test_loop_stats(true, 20000);
     test_timer();
     
     return 0;
@@ -14,8 +14,59 @@ void test_fiber()
     }
 }
 
+// 单线程下，任务里调度的任务应该从next槽里优先执行，而不是排到已经在队列里的任务后面
+// 第一个任务等主线程把3放进全局队列以后，才在运行中调度2
+void test_runnext()
+{
+    static std::vector<int> s_order;
+    static std::atomic<bool> s_queued = {false};
+    sylar::Scheduler sc(1, false, "next");
+    sc.start();
+    sc.schedule([]() {
+        while (!s_queued) {
+            usleep(1000);
+        }
+        sylar::Scheduler::GetThis()->schedule([]() {
+            s_order.push_back(2);
+        });
+        s_order.push_back(1);
+    });
+    sc.schedule([]() {
+        s_order.push_back(3);
+    });
+    s_queued = true;
+    sc.stop();
+    std::stringstream ss;
+    for (auto i : s_order) {
+        ss << i << " ";
+    }
+    SYLAR_LOG_INFO(g_logger) << "runnext order: " << ss.str();
+    SYLAR_ASSERT(s_order == std::vector<int>({1, 2, 3}));
+}
+
+// 协程在两个调度器之间来回切换
+void test_switch()
+{
+    sylar::Scheduler io(1, false, "io");
+    sylar::Scheduler cpu(1, false, "cpu");
+    io.start();
+    cpu.start();
+    io.schedule([&cpu]() {
+        SYLAR_LOG_INFO(g_logger) << "before switch thread=" << sylar::Thread::GetName();
+        {
+            sylar::SchedulerSwitcher sw(&cpu);
+            SYLAR_LOG_INFO(g_logger) << "in cpu thread=" << sylar::Thread::GetName();
+        }
+        SYLAR_LOG_INFO(g_logger) << "back thread=" << sylar::Thread::GetName();
+    });
+    io.stop();
+    cpu.stop();
+}
+
 int main(int argc, char **argv)
 {
+    test_runnext();
+    test_switch();
     SYLAR_LOG_INFO(g_logger) << "main";
     sylar::Scheduler sc(3, false, "test");
     sc.start();
@@ -0,0 +1,179 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/proxy.h"
+#include "sylar/hook.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const size_t CHUNK = 64 * 1024;
+
+// 本机建一条tcp连接，a是连接的一端，b是accept出来的另一端
+static void tcp_pair(int &a, int &b)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    bind(lsock, (sockaddr *)&addr, sizeof addr);
+    listen(lsock, 16);
+    socklen_t len = sizeof addr;
+    getsockname(lsock, (sockaddr *)&addr, &len);
+    a = socket(AF_INET, SOCK_STREAM, 0);
+    connect(a, (sockaddr *)&addr, sizeof addr);
+    b = accept(lsock, nullptr, nullptr);
+    close(lsock);
+}
+
+// 读完丢掉，返回读到的字节数
+static size_t drain(int fd)
+{
+    std::vector<char> buf(CHUNK);
+    size_t total = 0;
+    ssize_t n = 0;
+    while ((n = read(fd, &buf[0], buf.size())) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+static ssize_t copy(int fd_in, int fd_out)
+{
+    std::vector<char> buf(CHUNK);
+    ssize_t total = 0;
+    ssize_t n = 0;
+    while ((n = read(fd_in, &buf[0], buf.size())) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            ssize_t m = write(fd_out, &buf[off], n - off);
+            if (m <= 0) {
+                return -1;
+            }
+            off += m;
+        }
+        total += n;
+    }
+    return n < 0 ? -1 : total;
+}
+
+// 发送端 -> 代理 -> 接收端，代理那一跳用splice或者read/write
+void bench_proxy(bool use_splice, size_t bytes)
+{
+    uint64_t start = sylar::GetCurrentUS();
+    size_t received = 0;
+    ssize_t proxied = 0;
+    {
+        sylar::IOManager iom(2, false);
+        iom.schedule([&]() {
+            int src, src_peer, dst, dst_peer;
+            tcp_pair(src, src_peer);
+            tcp_pair(dst, dst_peer);
+            iom.schedule([src, bytes]() {
+                std::vector<char> buf(CHUNK, 'x');
+                for (size_t sent = 0; sent < bytes;) {
+                    ssize_t n = write(src, &buf[0], std::min(buf.size(), bytes - sent));
+                    if (n <= 0) {
+                        break;
+                    }
+                    sent += n;
+                }
+                close(src);
+            });
+            iom.schedule([&, src_peer, dst]() {
+                proxied = use_splice ? sylar::proxy(src_peer, dst) : copy(src_peer, dst);
+                close(src_peer);
+                close(dst);
+            });
+            received = drain(dst_peer);
+            close(dst_peer);
+        });
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "proxy " << (use_splice ? "splice" : "read/write") << " proxied=" << proxied
+        << " received=" << received << " used=" << used / 1000 << "ms "
+        << (received / 1024.0 / 1024) / (used / 1000000.0) << "MB/s";
+}
+
+// 文件 -> socket，sendfile或者read/write
+void bench_sendfile(bool use_sendfile, size_t bytes)
+{
+    const char *path = "/tmp/sylar_test_sendfile";
+    {
+        int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        std::vector<char> buf(CHUNK, 'y');
+        for (size_t n = 0; n < bytes; n += buf.size()) {
+            write_f(fd, &buf[0], buf.size());
+        }
+        close(fd);
+    }
+    uint64_t start = sylar::GetCurrentUS();
+    size_t received = 0;
+    {
+        sylar::IOManager iom(2, false);
+        iom.schedule([&]() {
+            int a, b;
+            tcp_pair(a, b);
+            iom.schedule([&, a]() {
+                int fd = open(path, O_RDONLY);
+                if (use_sendfile) {
+                    off_t off = 0;
+                    while (sendfile(a, fd, &off, bytes - off) > 0) {
+                    }
+                } else {
+                    copy(fd, a);
+                }
+                close(fd);
+                close(a);
+            });
+            received = drain(b);
+            close(b);
+        });
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    unlink(path);
+    SYLAR_LOG_INFO(g_logger) << "file " << (use_sendfile ? "sendfile" : "read/write") << " received=" << received
+        << " used=" << used / 1000 << "ms " << (received / 1024.0 / 1024) / (used / 1000000.0) << "MB/s";
+}
+
+// tee把管道里的数据复制一份到另一个管道，原管道里的数据还在
+void test_tee()
+{
+    sylar::IOManager iom(1);
+    iom.schedule([]() {
+        int p1[2], p2[2];
+        pipe(p1);
+        pipe(p2);
+        sylar::IOManager::GetThis()->schedule([p1]() {
+            usleep(50 * 1000);    // tee先挂起等输入
+            write(p1[1], "hello", 5);
+        });
+        uint64_t start = sylar::GetCurrentMS();
+        ssize_t n = tee(p1[0], p2[1], 5, 0);
+        char a[8] = {0}, b[8] = {0};
+        read(p1[0], a, 5);
+        read(p2[0], b, 5);
+        SYLAR_LOG_INFO(g_logger) << "tee n=" << n << " a=" << a << " b=" << b
+            << " used=" << sylar::GetCurrentMS() - start << "ms";
+        close(p1[0]);
+        close(p1[1]);
+        close(p2[0]);
+        close(p2[1]);
+    });
+}
+
+int main(int argc, char **argv)
+{
+    size_t mb = argc > 1 ? atoi(argv[1]) : 512;
+    test_tee();
+    for (int i = 0; i < 2; ++i) {
+        bench_proxy(false, mb << 20);
+        bench_proxy(true, mb << 20);
+    }
+    for (int i = 0; i < 2; ++i) {
+        bench_sendfile(false, (mb / 4) << 20);
+        bench_sendfile(true, (mb / 4) << 20);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include <fstream>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 从/proc/self/io里读出进程累计的read/write类系统调用次数
+static void read_proc_io(uint64_t &syscr, uint64_t &syscw)
+{
+    std::ifstream ifs("/proc/self/io");
+    std::string key;
+    uint64_t val = 0;
+    while (ifs >> key >> val) {
+        if (key == "syscr:") {
+            syscr = val;
+        } else if (key == "syscw:") {
+            syscw = val;
+        }
+    }
+}
+
+// 一批一批地schedule空任务，看唤醒idle线程一共产生了多少次read/write
+void bench_tickle(int threads, int bursts, int tasks)
+{
+    sylar::IOManager iom(threads, false, "tickle");
+    usleep(100 * 1000);    // 等所有线程都进入idle
+    uint64_t r0 = 0, w0 = 0, r1 = 0, w1 = 0;
+    read_proc_io(r0, w0);
+    uint64_t start = sylar::GetCurrentMS();
+    for (int i = 0; i < bursts; ++i) {
+        for (int j = 0; j < tasks; ++j) {
+            iom.schedule([]() {});
+        }
+        usleep(1000);
+    }
+    iom.stop();
+    read_proc_io(r1, w1);
+    SYLAR_LOG_ERROR(g_logger) << "threads=" << threads << " schedules=" << bursts * tasks
+        << " syscr=" << (r1 - r0) << " syscw=" << (w1 - w0)
+        << " used=" << (sylar::GetCurrentMS() - start) << "ms";
+}
+
+int main(int argc, char **argv)
+{
+    // 只留ERROR级别，避免日志本身的write也算进去
+    g_logger->setLevel(sylar::LogLevel::ERROR);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    bench_tickle(1, 100, 100);
+    bench_tickle(4, 100, 100);
+    return 0;
+}
@@ -0,0 +1,326 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/hook.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 定时器抖动：实际醒来的时间 - 要求的时间，按桶统计
+static const int64_t s_bounds[] = {-1000, 0, 20, 50, 100, 200, 500, 1000, 2000};
+static const size_t BUCKETS = sizeof(s_bounds) / sizeof(s_bounds[0]) + 1;
+
+static std::string histogram(const std::vector<int64_t> &lateness)
+{
+    std::vector<size_t> counts(BUCKETS);
+    for (auto l : lateness) {
+        size_t i = 0;
+        while (i < BUCKETS - 1 && l >= s_bounds[i]) {
+            ++i;
+        }
+        ++counts[i];
+    }
+    std::stringstream ss;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        if (!counts[i]) {
+            continue;
+        }
+        if (i == 0) {
+            ss << " <" << s_bounds[0];
+        } else if (i == BUCKETS - 1) {
+            ss << " >=" << s_bounds[i - 1];
+        } else {
+            ss << " [" << s_bounds[i - 1] << "," << s_bounds[i] << ")";
+        }
+        ss << "us:" << counts[i];
+    }
+    return ss.str();
+}
+
+// 一个协程连续usleep，记录每次醒来比要求的晚了多少微秒
+void test_sleep_jitter(useconds_t usec, int count)
+{
+    sylar::IOManager iom(1, false);
+    iom.schedule([usec, count]() {
+        std::vector<int64_t> lateness;
+        for (int i = 0; i < count; ++i) {
+            uint64_t start = sylar::GetCurrentUS();
+            usleep(usec);
+            lateness.push_back((int64_t)(sylar::GetCurrentUS() - start) - usec);
+        }
+        std::sort(lateness.begin(), lateness.end());
+        SYLAR_LOG_INFO(g_logger) << "usleep(" << usec << ") x" << count << " p50=" << lateness[count / 2]
+            << "us p99=" << lateness[count * 99 / 100] << "us max=" << lateness.back() << "us" << histogram(lateness);
+    });
+}
+
+// 定时器回调的抖动：同时挂很多个不同时长的定时器
+void test_timer_jitter(int count)
+{
+    sylar::IOManager iom(1, false);
+    std::vector<int64_t> lateness;
+    sylar::Mutex mutex;
+    for (int i = 0; i < count; ++i) {
+        uint64_t ms = 1 + i % 20;
+        uint64_t start = sylar::GetCurrentUS();
+        iom.addTimer(ms, [&, ms, start]() {
+            sylar::Mutex::Lock lock(mutex);
+            lateness.push_back((int64_t)(sylar::GetCurrentUS() - start) - ms * 1000);
+        });
+    }
+    iom.stop();
+    std::sort(lateness.begin(), lateness.end());
+    SYLAR_LOG_INFO(g_logger) << "addTimer(1..20ms) x" << count << " p50=" << lateness[count / 2]
+        << "us p99=" << lateness[count * 99 / 100] << "us max=" << lateness.back() << "us" << histogram(lateness);
+}
+
+// 事件循环缓存的时钟：同一圈里Now()不变，RefreshNow以后才往前走；定时器从缓存的时间算起
+void test_cached_clock()
+{
+    sylar::IOManager iom(1, false);
+    iom.schedule([&iom]() {
+        usleep(100);    // 走一圈事件循环，醒来时缓存了时钟
+        uint64_t cached = sylar::TimerManager::Now();
+        uint64_t start = sylar::GetMonotonicUS();
+        while (sylar::GetMonotonicUS() - start < 2000) {
+        }
+        uint64_t stale = sylar::TimerManager::Now();
+        iom.addTimer(5, [start]() {    // 从缓存的时间算，比现在早了2ms
+            SYLAR_LOG_INFO(g_logger) << "5ms timer from cached clock fired " << sylar::GetMonotonicUS() - start << "us after the cached time";
+        });
+        uint64_t refreshed = sylar::TimerManager::RefreshNow();
+        iom.addTimer(5, [refreshed]() {
+            SYLAR_LOG_INFO(g_logger) << "5ms timer from refreshed clock fired " << sylar::GetMonotonicUS() - refreshed << "us after refresh";
+        });
+        SYLAR_LOG_INFO(g_logger) << "cached clock after 2ms busy: moved=" << stale - cached
+            << "us refreshed=" << refreshed - cached << "us";
+    });
+}
+
+// 懒刷新的空闲超时：每5ms刷新一次，刷新10次，最后一次刷新后20ms到期；条件释放了的定时器不执行
+void test_lazy_refresh()
+{
+    sylar::IOManager iom(1, false);
+    iom.schedule([&iom]() {
+        uint64_t start = sylar::GetMonotonicUS();
+        std::shared_ptr<uint64_t> last(new uint64_t(start));
+        auto timer = iom.addTimer(20, [last]() {
+            SYLAR_LOG_INFO(g_logger) << "lazy idle timeout fired " << sylar::GetMonotonicUS() - *last << "us after last refresh";
+        });
+        timer->setLazyRefresh(true);
+        std::shared_ptr<int> cond(new int(0));
+        iom.addConditionTimer(10, []() {
+            SYLAR_LOG_ERROR(g_logger) << "condition timer fired after its condition was released";
+        }, cond);
+        cond.reset();
+        for (int i = 0; i < 10; ++i) {
+            usleep(5000);
+            *last = sylar::TimerManager::Now();
+            timer->refresh();
+        }
+
+        // 取消了的、已经执行过的懒刷新定时器，refresh返回false，也不会再执行
+        auto cancelled = iom.addTimer(5, []() {
+            SYLAR_LOG_ERROR(g_logger) << "cancelled lazy timer fired";
+        });
+        cancelled->setLazyRefresh(true);
+        SYLAR_ASSERT(cancelled->refresh());
+        SYLAR_ASSERT(cancelled->cancle());
+        SYLAR_ASSERT(!cancelled->refresh());
+        auto fired = iom.addTimer(1, []() {});
+        fired->setLazyRefresh(true);
+        usleep(10000);
+        SYLAR_ASSERT(!fired->refresh());
+    });
+}
+
+// 每个线程一个队列并且use_caller：主线程和工作线程加的定时器在stop()之前都要执行完
+void test_use_caller_drain(int count)
+{
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(true);
+    std::atomic<int> fired = {0};
+    {
+        sylar::IOManager iom(3, true);
+        for (int i = 0; i < count; ++i) {
+            iom.addTimer(1 + i % 20, [&fired]() {
+                ++fired;
+            });
+            iom.schedule([&iom, &fired, i]() {
+                iom.addTimer(1 + i % 20, [&fired]() {
+                    ++fired;
+                });
+            });
+        }
+        iom.stop();
+    }
+    SYLAR_LOG_INFO(g_logger) << "use_caller per thread queues fired=" << fired << "/" << count * 2;
+    SYLAR_ASSERT(fired == count * 2);
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(false);
+}
+
+// 定时器合并：count个定时器随机分布在1秒内，看事件循环醒了多少次、最多晚了多少
+void test_slack(uint64_t slack_us, int count)
+{
+    std::vector<int64_t> lateness;
+    sylar::Mutex mutex;
+    uint64_t start = sylar::GetMonotonicUS();
+    sylar::IOManager::PollStats stats;
+    {
+        sylar::IOManager iom(1, false);
+        iom.setTimerSlackUs(slack_us);
+        for (int i = 0; i < count; ++i) {
+            uint64_t us = 1000 + rand() % 1000000;
+            uint64_t begin = sylar::GetMonotonicUS();
+            iom.addTimerUs(us, [&, us, begin]() {
+                sylar::Mutex::Lock lock(mutex);
+                lateness.push_back((int64_t)(sylar::GetMonotonicUS() - begin) - us);
+            });
+        }
+        iom.stop();
+        stats = iom.getPollStats();
+    }
+    uint64_t used = sylar::GetMonotonicUS() - start;
+    std::sort(lateness.begin(), lateness.end());
+    SYLAR_LOG_INFO(g_logger) << "slack=" << slack_us << "us timers=" << count << " wakeups=" << stats.loops
+        << " (" << stats.loops * 1000000 / used << "/s) p50=" << lateness[count / 2] << "us p99="
+        << lateness[count * 99 / 100] << "us max=" << lateness.back() << "us";
+}
+
+class BenchTimerManager : public sylar::TimerManager {
+protected:
+    void onTimerInsertAtFront(size_t queue) override {}
+};
+
+// 大量定时器的增删改查耗时，模拟很多连接各挂一个超时定时器
+void bench_timers(int count)
+{
+    BenchTimerManager mgr;
+    std::vector<sylar::Timer::ptr> timers(count);
+    std::vector<uint64_t> delays(count);
+    for (int i = 0; i < count; ++i) {
+        delays[i] = 1000 + rand() % 60000;
+    }
+    uint64_t fired = 0;
+    auto cb = [&fired]() { ++fired; };
+
+    uint64_t start = sylar::GetCurrentUS();
+    for (int i = 0; i < count; ++i) {
+        timers[i] = mgr.addTimer(delays[i], cb);
+    }
+    uint64_t add_us = sylar::GetCurrentUS() - start;
+
+    start = sylar::GetCurrentUS();
+    for (int i = 0; i < count; i += 2) {
+        timers[i]->refresh();
+    }
+    uint64_t refresh_us = sylar::GetCurrentUS() - start;
+
+    for (int i = 0; i < count; i += 2) {
+        timers[i]->setLazyRefresh(true);
+    }
+    start = sylar::GetCurrentUS();
+    for (int i = 0; i < count; i += 2) {
+        timers[i]->refresh();
+    }
+    uint64_t lazy_us = sylar::GetCurrentUS() - start;
+    for (int i = 0; i < count; i += 2) {
+        timers[i]->setLazyRefresh(false);
+    }
+
+    start = sylar::GetCurrentUS();
+    for (int i = 0; i < count; i += 2) {
+        timers[i]->reset(delays[i] / 2, true);
+    }
+    uint64_t reset_us = sylar::GetCurrentUS() - start;
+
+    start = sylar::GetCurrentUS();
+    for (int i = 0; i < count; ++i) {
+        timers[i]->cancle();
+    }
+    uint64_t cancel_us = sylar::GetCurrentUS() - start;
+
+    // 加了马上取消，定时器对象用完就释放，看分配的开销
+    start = sylar::GetCurrentUS();
+    for (int i = 0; i < count; ++i) {
+        mgr.addTimer(delays[i], cb)->cancle();
+    }
+    uint64_t churn_us = sylar::GetCurrentUS() - start;
+
+    // 全部到期：定时在1~100ms，循环取到期的直到取完
+    for (int i = 0; i < count; ++i) {
+        mgr.addTimer(1 + i % 100, cb);
+    }
+    start = sylar::GetCurrentUS();
+    uint64_t collect_us = 0;
+    std::vector<std::function<void()>> cbs;
+    uint64_t loops = 0;
+    while (fired < (uint64_t)count) {
+        usleep(100);
+        uint64_t t = sylar::GetCurrentUS();
+        mgr.listExpiredCb(cbs);
+        collect_us += sylar::GetCurrentUS() - t;
+        for (auto &i : cbs) {
+            i();
+        }
+        cbs.clear();
+        ++loops;
+    }
+    uint64_t expire_us = sylar::GetCurrentUS() - start;
+
+    SYLAR_LOG_INFO(g_logger) << "bench " << count << " timers(ns/op): add=" << add_us * 1000 / count
+        << " refresh=" << refresh_us * 2000 / count << " lazy_refresh=" << lazy_us * 2000 / count << " reset=" << reset_us * 2000 / count
+        << " cancel=" << cancel_us * 1000 / count << " add+cancel=" << churn_us * 1000 / count << " expire=" << collect_us * 1000 / count
+        << " (" << expire_us / 1000 << "ms, " << loops << " loops)";
+    sylar::TimerManager::ClearNow();    // listExpiredCb在主线程里缓存了时钟
+}
+
+// 多个线程同时加/取消定时器(模拟每个连接每次读写挂一个超时)，中间穿插usleep让事件循环去取到期的
+void bench_threads(bool per_thread_epoll, int threads, int ops)
+{
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(per_thread_epoll);
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false);
+        for (int i = 0; i < threads * 4; ++i) {
+            iom.schedule([&iom, ops]() {
+                for (int j = 0; j < ops; ++j) {
+                    auto timer = iom.addTimer(1000 + j % 1000, []() {});
+                    timer->cancle();
+                    if (j % 64 == 0) {
+                        usleep(100);
+                    }
+                }
+            });
+        }
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "threads=" << threads << " per_thread_epoll=" << per_thread_epoll
+        << " add+cancel x" << threads * 4 * ops << " used=" << used / 1000 << "ms "
+        << used * 1000 / (threads * 4 * ops) << "ns/op";
+    sylar::Config::Lookup<bool>("iomanager.per_thread_epoll")->setValue(false);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        for (int i = 0; i < 3; ++i) {
+            bench_timers(atoi(argv[1]));
+        }
+        for (int i = 0; i < 2; ++i) {
+            bench_threads(false, 4, atoi(argv[1]) / 10);
+            bench_threads(true, 4, atoi(argv[1]) / 10);
+        }
+        return 0;
+    }
+    test_sleep_jitter(50, 200);
+    test_sleep_jitter(200, 200);
+    test_sleep_jitter(1000, 200);
+    test_sleep_jitter(1500, 200);
+    test_sleep_jitter(10000, 50);
+    test_timer_jitter(1000);
+    test_cached_clock();
+    test_lazy_refresh();
+    test_use_caller_drain(100);
+    test_slack(0, 5000);
+    test_slack(1000, 5000);
+    test_slack(10000, 5000);
+    return 0;
+}
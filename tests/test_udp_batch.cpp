@@ -0,0 +1,142 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/udp_batch.h"
+#include "sylar/hook.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const size_t PAYLOAD = 64;
+
+enum Mode {
+    SINGLE,     // 一个报文一次sendto/recvfrom
+    BATCH,      // sendmmsg/recvmmsg一次64个
+    GSO         // 再加上GSO/GRO，64个小报文拼成一个发
+};
+
+static const char *s_names[] = {"single", "batch", "gso"};
+
+static int udp_socket(sockaddr_in &addr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (sockaddr *)&addr, sizeof addr);
+    socklen_t len = sizeof addr;
+    getsockname(sock, (sockaddr *)&addr, &len);
+    return sock;
+}
+
+// 收发协程放在不同的线程上，发1秒，收的那边200ms收不到就结束
+void bench(Mode mode, uint64_t duration_ms)
+{
+    uint64_t sent = 0, received = 0, calls = 0;
+    uint64_t start = sylar::GetCurrentUS();
+    uint64_t send_used = 0;
+    {
+        sylar::IOManager iom(2, false);
+        auto ids = iom.getThreadIds();
+        sockaddr_in raddr, saddr;
+        int rsock = udp_socket(raddr);
+        int ssock = udp_socket(saddr);
+        int rcvbuf = 8 << 20;
+        setsockopt(rsock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+        timeval tv = {0, 200 * 1000};
+        setsockopt(rsock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        bool gro = mode == GSO && sylar::UdpBatch::EnableGro(rsock);
+
+        iom.schedule([&, rsock]() {
+            if (mode == SINGLE) {
+                char buf[2048];
+                while (recvfrom(rsock, buf, sizeof buf, 0, nullptr, nullptr) > 0) {
+                    ++received;
+                }
+            } else {
+                sylar::UdpBatch batch(64, gro ? 65536 : 2048);
+                int n = 0;
+                while ((n = batch.recv(rsock)) > 0) {
+                    for (int i = 0; i < n; ++i) {
+                        size_t seg = batch.segmentSize(i);
+                        received += seg ? (batch.size(i) + seg - 1) / seg : 1;
+                    }
+                }
+            }
+            close(rsock);
+        }, ids[0]);
+
+        iom.schedule([&, ssock]() {
+            char payload[PAYLOAD];
+            memset(payload, 'u', sizeof payload);
+            uint64_t deadline = sylar::GetCurrentMS() + duration_ms;
+            sylar::UdpBatch batch(64, mode == GSO ? 64 * PAYLOAD : 2048);
+            if (mode == GSO) {
+                batch.setGso(PAYLOAD);
+            }
+            while (sylar::GetCurrentMS() < deadline) {
+                if (mode == SINGLE) {
+                    for (int i = 0; i < 64; ++i) {
+                        if (sendto(ssock, payload, sizeof payload, 0, (sockaddr *)&raddr, sizeof raddr) > 0) {
+                            ++sent;
+                        }
+                        ++calls;
+                    }
+                } else {
+                    for (int i = 0; i < 64; ++i) {
+                        batch.add(payload, sizeof payload, (sockaddr *)&raddr, sizeof raddr);
+                    }
+                    if (batch.flush(ssock) > 0) {
+                        sent += 64;
+                    }
+                    ++calls;
+                }
+            }
+            send_used = sylar::GetCurrentUS() - start;
+            close(ssock);
+        }, ids[1]);
+    }
+    double secs = send_used / 1000000.0;
+    SYLAR_LOG_INFO(g_logger) << s_names[mode] << " calls=" << calls << " sent=" << sent << " received=" << received
+        << " send_pps=" << (uint64_t)(sent / secs) << " recv_pps=" << (uint64_t)(received / secs)
+        << " loss=" << (sent ? 100.0 * (sent - std::min(sent, received)) / sent : 0) << "%";
+}
+
+// 一个2*gso的报文后面跟一个gso的报文，不能拼到一起，否则收到的是3个gso的报文
+void test_gso_boundary()
+{
+    const size_t gso = 100;
+    sockaddr_in raddr, saddr;
+    int rsock = udp_socket(raddr);
+    int ssock = udp_socket(saddr);
+    char payload[2 * gso];
+    memset(payload, 'g', sizeof payload);
+    sylar::UdpBatch batch(4, 4 * gso);
+    batch.setGso(gso);
+    batch.add(payload, 2 * gso, (sockaddr *)&raddr, sizeof raddr);
+    batch.add(payload, gso, (sockaddr *)&raddr, sizeof raddr);
+    int sent = batch.flush(ssock);
+
+    std::vector<ssize_t> lens;
+    char buf[4 * gso];
+    ssize_t n = 0;
+    while ((n = recvfrom(rsock, buf, sizeof buf, MSG_DONTWAIT, nullptr, nullptr)) > 0) {
+        lens.push_back(n);
+    }
+    SYLAR_LOG_INFO(g_logger) << "gso boundary sent=" << sent << " received=" << lens.size();
+    SYLAR_ASSERT(lens.size() == 2 && lens[0] == (ssize_t)(2 * gso) && lens[1] == (ssize_t)gso);
+    close(rsock);
+    close(ssock);
+}
+
+int main(int argc, char **argv)
+{
+    test_gso_boundary();
+    uint64_t ms = argc > 1 ? atoi(argv[1]) : 1000;
+    for (int i = 0; i < 2; ++i) {
+        bench(SINGLE, ms);
+        bench(BATCH, ms);
+        bench(GSO, ms);
+    }
+    return 0;
+}
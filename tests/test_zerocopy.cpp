@@ -0,0 +1,97 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/hook.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const size_t BLOCK = 1024 * 1024;
+static const int BUFS = 4;
+
+static void tcp_pair(int &a, int &b)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    bind(lsock, (sockaddr *)&addr, sizeof addr);
+    listen(lsock, 16);
+    socklen_t len = sizeof addr;
+    getsockname(lsock, (sockaddr *)&addr, &len);
+    a = socket(AF_INET, SOCK_STREAM, 0);
+    connect(a, (sockaddr *)&addr, sizeof addr);
+    b = accept(lsock, nullptr, nullptr);
+    close(lsock);
+}
+
+// 第i个1MB块的内容全是(char)i；BUFS个buffer轮流用，release之前不能改，接收端逐字节检查，提前release的话内容会对不上
+void bench_send(bool zerocopy, size_t blocks)
+{
+    sylar::IOManager iom(2, false);
+    uint64_t start = sylar::GetCurrentUS();
+    iom.schedule([&]() {
+        int a, b;
+        tcp_pair(a, b);
+        bool enabled = zerocopy && iom.enableZeroCopy(a);
+        iom.schedule([&iom, a, blocks, enabled]() {
+            std::vector<std::vector<char>> bufs(BUFS, std::vector<char>(BLOCK));
+            std::shared_ptr<std::atomic<bool>> busy(new std::atomic<bool>[BUFS], std::default_delete<std::atomic<bool>[]>());
+            for (int i = 0; i < BUFS; ++i) {
+                busy.get()[i] = false;
+            }
+            for (size_t i = 0; i < blocks; ++i) {
+                int idx = i % BUFS;
+                if (busy.get()[idx]) {
+                    iom.flushZeroCopy(a);
+                }
+                memset(&bufs[idx][0], (char)i, BLOCK);
+                if (enabled) {
+                    busy.get()[idx] = true;
+                    iom.sendZeroCopy(a, &bufs[idx][0], BLOCK, [busy, idx]() {
+                        busy.get()[idx] = false;
+                    });
+                } else {
+                    for (size_t off = 0; off < BLOCK;) {
+                        off += write(a, &bufs[idx][off], BLOCK - off);
+                    }
+                }
+            }
+            bool released = false;
+            iom.sendZeroCopy(a, "tail", 4, [&released]() { released = true; });    // 小的直接拷贝，返回前就release了
+            iom.flushZeroCopy(a);
+            SYLAR_LOG_INFO(g_logger) << "small send released=" << released;
+            close(a);
+        });
+
+        std::vector<char> buf(256 * 1024);
+        size_t total = 0;
+        size_t bad = 0;
+        ssize_t n = 0;
+        while ((n = read(b, &buf[0], buf.size())) > 0) {
+            for (ssize_t i = 0; i < n; ++i, ++total) {
+                if (total < blocks * BLOCK && buf[i] != (char)(total / BLOCK)) {
+                    ++bad;
+                }
+            }
+        }
+        close(b);
+        uint64_t used = sylar::GetCurrentUS() - start;
+        auto stats = iom.getZeroCopyStats();
+        SYLAR_LOG_INFO(g_logger) << (zerocopy ? "zerocopy" : "copy") << " enabled=" << enabled
+            << " received=" << total << " bad=" << bad << " used=" << used / 1000 << "ms "
+            << (total / 1024.0 / 1024) / (used / 1000000.0) << "MB/s sends=" << stats.sends
+            << " completions=" << stats.completions << " copied=" << stats.copied << " fallbacks=" << stats.fallbacks;
+    });
+}
+
+int main(int argc, char **argv)
+{
+    size_t blocks = argc > 1 ? atoi(argv[1]) : 512;
+    for (int i = 0; i < 2; ++i) {
+        bench_send(false, blocks);
+        bench_send(true, blocks);
+    }
+    return 0;
+}